@@ -41,6 +41,8 @@ bool operator!=(const BUTTONS& lhs, const BUTTONS& rhs) {
 client::client(shared_ptr<client_dialog> dialog) :
     connection(service), timer(service), my_dialog(dialog)
 {
+    receive_bounds = TO_CLIENT_BOUNDS;
+
     QOS_VERSION version;
     version.MajorVersion = 1;
     version.MinorVersion = 0;
@@ -173,7 +175,7 @@ void client::ping_public_server_list() {
             }
             auto p(make_shared<packet>());
             *p << SERVER_PING << timestamp();
-            socket->async_send(buffer(*p), [=](const error_code& error, size_t transferred) {
+            socket->async_send(buffer(p->data(), p->size()), [=](const error_code& error, size_t transferred) {
                 if (s.expired()) return;
                 p->reset();
                 if (error) return done(e.first, SERVER_STATUS_ERROR, socket);
@@ -187,7 +189,7 @@ void client::ping_public_server_list() {
                     error_code ec;
                     p->resize(socket->available(ec));
                     if (ec) return done(e.first, SERVER_STATUS_ERROR, socket);
-                    p->resize(socket->receive(buffer(*p), 0, ec));
+                    p->resize(socket->receive(buffer(p->data(), p->size()), 0, ec));
                     if (ec) return done(e.first, SERVER_STATUS_ERROR, socket);
                     if (p->size() < 13 || p->read<query_type>() != SERVER_PONG) {
                         return done(e.first, SERVER_STATUS_VERSION_MISMATCH, socket);
@@ -220,7 +222,7 @@ void client::get_external_address() {
             socket->connect(*iterator);
             auto p(make_shared<packet>());
             *p << EXTERNAL_ADDRESS;
-            socket->async_send(buffer(*p), [=](const error_code& error, size_t transferred) {
+            socket->async_send(buffer(p->data(), p->size()), [=](const error_code& error, size_t transferred) {
                 if (s.expired()) return;
                 p->reset();
                 if (error) return;
@@ -234,7 +236,7 @@ void client::get_external_address() {
                     error_code ec;
                     p->resize(socket->available(ec));
                     if (ec) return;
-                    p->resize(socket->receive(buffer(*p), 0, ec));
+                    p->resize(socket->receive(buffer(p->data(), p->size()), 0, ec));
                     if (ec) return;
                     if (p->read<query_type>() != EXTERNAL_ADDRESS) return;
                     if (p->available() >= sizeof(uint16_t)) p->read<uint16_t>();
@@ -512,7 +514,7 @@ void client::on_message(string message) {
             } else if (params[0] == "/golf") {
                 if (!is_open()) throw runtime_error("Not connected");
                 set_golf_mode(!golf);
-                send(packet() << GOLF << golf);
+                send<to_server<GOLF>>(golf);
                 for (auto& u : user_list) {
                     change_input_authority(u->id, (golf ? me->id : u->id));
                 }
@@ -704,9 +706,7 @@ void client::connect(const string& host, uint16_t port, const string& room) {
 
     my_dialog->info("Connected!");
 
-    query_udp_port([=]() {
-        send_join(room, external_udp_port);
-    });
+    send_join(room);
 
     receive_tcp_packet();
 }
@@ -714,7 +714,8 @@ void client::connect(const string& host, uint16_t port, const string& room) {
 void client::on_receive(packet& p, bool udp) {
     switch (p.read<packet_type>()) {
         case VERSION: {
-            auto protocol_version = p.read<uint32_t>();
+            uint32_t protocol_version;
+            read_message<to_client<VERSION>>(p, protocol_version);
             if (protocol_version != PROTOCOL_VERSION) {
                 close();
                 my_dialog->error("Server protocol version does not match client protocol version. Visit www.play64.com to get the latest version of the plugin.");
@@ -723,7 +724,8 @@ void client::on_receive(packet& p, bool udp) {
         }
 
         case JOIN: {
-            auto info = p.read<user_info>();
+            user_info info;
+            read_message<to_client<JOIN>>(p, info);
             my_dialog->info(info.name + " has joined");
             auto u = make_shared<user_info>(info);
             user_map.push_back(u);
@@ -734,8 +736,10 @@ void client::on_receive(packet& p, bool udp) {
 
         case ACCEPT: {
             auto udp_port = p.read<uint16_t>();
+            auto udp_token = p.read<uint32_t>();
             if (udp_socket && udp_port) {
                 udp_socket->connect(ip::udp::endpoint(tcp_socket->remote_endpoint().address(), udp_port));
+                udp_header.reset() << USER_DATA << udp_token;
                 if (qos_handle != NULL) {
                     QOS_FLOWID flowId = 0;
                     QOSAddSocketToFlow(qos_handle, udp_socket->native_handle(), udp_socket->remote_endpoint().data(), QOSTrafficTypeAudioVideo, QOS_NON_ADAPTIVE_FLOW, &flowId);
@@ -762,7 +766,7 @@ void client::on_receive(packet& p, bool udp) {
         }
 
         case PATH: {
-            path = p.read<string>();
+            read_message<to_client<PATH>>(p, path);
             my_dialog->info(
                 "Others may join with the following command:\r\n\r\n"
                 "/join " + (host == "127.0.0.1" ? (external_address.is_unspecified() ? "<Your IP>" : external_address.to_string()) : host) + (port == 6400 ? "" : ":" + to_string(port)) + (path == "/" ? "" : path) + "\r\n"
@@ -770,36 +774,18 @@ void client::on_receive(packet& p, bool udp) {
             break;
         }
 
-        case PING: {
-            packet pong;
-            pong << PONG;
-            while (p.available()) {
-                pong << p.read<uint8_t>();
-            }
-            if (udp) {
-                send_udp(pong);
-            } else {
-                send(pong);
-            }
-            break;
-        }
-
-        case PONG: {
-            if (udp && !udp_established) {
-                udp_established = true;
-                tcp_socket->set_option(ip::tcp::no_delay(false));
-            }
-            break;
-        }
-
         case QUIT: {
-            remove_user(p.read<uint32_t>());
+            uint32_t user_id;
+            read_message<to_client<QUIT>>(p, user_id);
+            remove_user(user_id);
             break;
         }
 
         case NAME: {
-            auto user = user_map.at(p.read<uint32_t>());
-            auto name = p.read<string>();
+            uint32_t user_id;
+            string name;
+            read_message<to_client<NAME>>(p, user_id, name);
+            auto user = user_map.at(user_id);
             my_dialog->info(user->name + " is now " + name);
             user->name = name;
             update_user_list();
@@ -815,8 +801,9 @@ void client::on_receive(packet& p, bool udp) {
         }
 
         case MESSAGE: {
-            auto user_id = p.read<uint32_t>();
-            auto message = p.read<string>();
+            uint32_t user_id;
+            string message;
+            read_message<to_client<MESSAGE>>(p, user_id, message);
             message_received(user_id, message);
             break;
         }
@@ -864,48 +851,28 @@ void client::on_receive(packet& p, bool udp) {
         }
 
         case GOLF: {
-            set_golf_mode(p.read<bool>());
+            bool mode;
+            read_message<to_client<GOLF>>(p, mode);
+            set_golf_mode(mode);
             break;
         }
 
         case INPUT_MAP: {
-            auto user = user_map.at(p.read<uint32_t>());
+            uint32_t user_id;
+            input_map map;
+            read_message<to_client<INPUT_MAP>>(p, user_id, map);
+            auto user = user_map.at(user_id);
             if (!user) break;
-            user->map = p.read<input_map>();
+            user->map = map;
             update_user_list();
             break;
         }
 
-        case INPUT_DATA: {
-            while (p.available()) {
-                auto user = user_map.at(p.read_var<uint32_t>());
-                if (!user) continue;
-                auto input_id = p.read_var<uint32_t>();
-                packet pin;
-                pin.transpose(p.read_rle(), input_data::SIZE);
-                while (pin.available()) {
-                    auto input = pin.read<input_data>();
-                    if (!user->add_input_history(input_id++, input)) continue;
-                    user->input_queue.push_back(input);
-                    if (golf && me->authority == me->id && input_detected(input, golf_mode_mask)) {
-                        change_input_authority(me->id, user->id);
-                    }
-                }
-            }
-            on_input();
-            break;
-        }
-
-        case INPUT_UPDATE: {
-            auto user = user_map.at(p.read<uint32_t>());
-            if (!user) break;
-            user->input = p.read<input_data>();
-            break;
-        }
-
         case REQUEST_AUTHORITY: {
-            auto user = user_map.at(p.read<uint32_t>());
-            auto authority = user_map.at(p.read<uint32_t>());
+            uint32_t user_id, authority_id;
+            read_message<to_client<REQUEST_AUTHORITY>>(p, user_id, authority_id);
+            auto user = user_map.at(user_id);
+            auto authority = user_map.at(authority_id);
             if (!user || !authority) break;
             if (user->authority == me->id) {
                 change_input_authority(user->id, authority->id);
@@ -914,8 +881,10 @@ void client::on_receive(packet& p, bool udp) {
         }
 
         case DELEGATE_AUTHORITY: {
-            auto user = user_map.at(p.read<uint32_t>());
-            auto authority = user_map.at(p.read<uint32_t>());
+            uint32_t user_id, authority_id;
+            read_message<to_client<DELEGATE_AUTHORITY>>(p, user_id, authority_id);
+            auto user = user_map.at(user_id);
+            auto authority = user_map.at(authority_id);
             if (!user || !authority) break;
             user->authority = authority->id;
             if (user->authority == me->id) {
@@ -931,6 +900,75 @@ void client::on_receive(packet& p, bool udp) {
     }
 }
 
+bool client::on_receive(packet_reader r, bool udp) {
+    packet_type type;
+    r.read(type);
+    switch (type) {
+        case PING: {
+            packet pong;
+            pong << PONG;
+            pong.insert(pong.end(), r.position(), r.position() + r.available());
+            if (udp) {
+                send_udp(pong);
+            } else {
+                send(pong);
+            }
+            break;
+        }
+
+        case PONG: {
+            if (udp && !udp_established) {
+                udp_established = true;
+                tcp_socket->set_option(ip::tcp::no_delay(false));
+            }
+            break;
+        }
+
+        case INPUT_DATA: {
+            uint32_t user_id, input_id;
+            r.read_var(user_id);
+            r.read_var(input_id);
+            if (user_id >= user_map.size()) r.fail();
+            if (!r) break;
+            auto user = user_map[user_id];
+            if (!user) break;
+            bool overflow = false;
+            user->add_input_window(r, input_id, [&](const input_data& input) {
+                if (!user->input_queue.push_back(input)) overflow = true;
+                if (golf && me->authority == me->id && input_detected(input, golf_mode_mask)) {
+                    change_input_authority(me->id, user->id);
+                }
+            });
+            if (overflow) {
+                // Over UDP too, since the frame is already in the history and won't be queued again
+                my_dialog->error("Input queue overflow");
+                close();
+                return true;
+            }
+            on_input();
+            break;
+        }
+
+        case INPUT_UPDATE: {
+            uint32_t user_id;
+            input_data input;
+            read_message<to_client<INPUT_UPDATE>>(r, user_id, input);
+            if (user_id >= user_map.size()) r.fail();
+            if (!r) break;
+            auto user = user_map[user_id];
+            if (!user) break;
+            user->input = input;
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    if (!r) on_malformed(udp);
+    return true;
+}
+
 void client::map_src_to_dst() {
     me->map = input_map::IDENTITY_MAP;
     for (int i = 0; i < 4; i++) {
@@ -1023,42 +1061,42 @@ void client::on_tick() {
     });
 }
 
-void client::send_join(const string& room, uint16_t udp_port) {
-    send(packet() << JOIN << PROTOCOL_VERSION << room << *me << udp_port);
+void client::send_join(const string& room) {
+    send<to_server<JOIN>>(PROTOCOL_VERSION, room, *me);
 }
 
 void client::send_name() {
-    send(packet() << NAME << me->name);
+    send<to_server<NAME>>(me->name);
 }
 
 void client::send_message(const string& message) {
-    send(packet() << MESSAGE << message);
+    send<to_server<MESSAGE>>(message);
 }
 
 void client::send_controllers() {
-    packet p;
-    p << CONTROLLERS;
-    for (auto& c : me->controllers) {
-        p << c;
-    }
-    send(p);
+    auto& c = me->controllers;
+    send<to_server<CONTROLLERS>>(c[0], c[1], c[2], c[3]);
 }
 
 void client::send_start_game() {
-    send(packet() << START);
+    send<to_server<START>>();
 }
 
 void client::send_lag(uint8_t lag, bool my_lag, bool your_lag) {
-    send(packet() << LAG << lag << my_lag << your_lag);
+    send<to_server<LAG>>(lag, my_lag, your_lag);
 }
 
 void client::send_autolag(int8_t value) {
-    send(packet() << AUTOLAG << value);
+    send<to_server<AUTOLAG>>(value);
 }
 
 void client::send_input(user_info& user) {
     user.add_input_history(user.input_id, user.input);
-    user.input_queue.push_back(user.input);
+    if (!user.input_queue.push_back(user.input)) {
+        my_dialog->error("Input queue overflow");
+        if (is_open()) close(); // close sends our input again, offline, so it only runs once
+        return;
+    }
 
     if (!is_open()) return;
 
@@ -1067,7 +1105,7 @@ void client::send_input(user_info& user) {
         p << INPUT_DATA;
         p.write_var(user.id);
         p.write_var(user.input_id - user.input_history.size());
-        p.write_rle(packet() << user.input_history);
+        write_input_window(p, user.input_history);
         send_udp(p, false);
     }
 
@@ -1075,34 +1113,34 @@ void client::send_input(user_info& user) {
     p << INPUT_DATA;
     p.write_var(user.id);
     p.write_var(user.input_id - 1);
-    p.write_rle(packet() << user.input_history.back());
+    write_input_window(p, user.input_history, user.input_history.size() - 1);
     send(p, false);
 }
 
 void client::send_input_update(const input_data& input) {
     if (udp_established) {
-        send_udp(packet() << INPUT_UPDATE << input);
+        send_udp<to_server<INPUT_UPDATE>>(input);
     } else {
-        send(packet() << INPUT_UPDATE << input);
+        send<to_server<INPUT_UPDATE>>(input);
     }
 }
 
 void client::send_input_map(input_map map) {
-    send(packet() << INPUT_MAP << map);
+    send<to_server<INPUT_MAP>>(map);
 }
 
 void client::send_input_rate(float rate) {
-    send(packet() << INPUT_RATE << rate);
+    send<to_server<INPUT_RATE>>(rate);
 }
 
 void client::send_udp_ping() {
-    send_udp(packet() << PING << timestamp());
+    send_udp<to_server<PING>>(timestamp());
 }
 
 void client::send_request_authority(uint32_t user_id, uint32_t authority_id) {
-    send(packet() << REQUEST_AUTHORITY << user_id << authority_id);
+    send<to_server<REQUEST_AUTHORITY>>(user_id, authority_id);
 }
 
 void client::send_delegate_authority(uint32_t user_id, uint32_t authority_id) {
-    send(packet() << DELEGATE_AUTHORITY << user_id << authority_id);
+    send<to_server<DELEGATE_AUTHORITY>>(user_id, authority_id);
 }
@@ -27,6 +27,7 @@ class client: public service_wrapper, public connection {
         void post_close();
         client_dialog& get_dialog();
         virtual void on_receive(packet& packet, bool udp);
+        virtual bool on_receive(packet_reader message, bool udp);
         virtual void on_error(const std::error_code& error);
     private:
         constexpr static uint32_t MARIO_GOLF_MASK = 0xFFFFF0F0;
@@ -76,7 +77,7 @@ class client: public service_wrapper, public connection {
         void change_input_authority(uint32_t user_id, uint32_t authority_id);
         void set_input_map(input_map map);
         void set_golf_mode(bool golf);
-        void send_join(const std::string& room, uint16_t udp_port);
+        void send_join(const std::string& room);
         void send_name();
         void send_controllers();
         void send_message(const std::string& message);
@@ -11,6 +11,26 @@ double timestamp() {
     return duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count() / 1000000.0;
 }
 
+// Runs handlers until the service stops. With a spin budget, it keeps polling for that long after the last handler before blocking
+void run_service(io_service& service, std::chrono::microseconds spin_budget) {
+    if (spin_budget <= std::chrono::microseconds::zero()) {
+        service.run();
+        return;
+    }
+
+    while (!service.stopped()) {
+        auto deadline = std::chrono::steady_clock::now() + spin_budget;
+        while (!service.stopped()) {
+            if (service.poll()) {
+                deadline = std::chrono::steady_clock::now() + spin_budget;
+            } else if (std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+        }
+        service.run_one();
+    }
+}
+
 void log(const string& message) {
     log(cout, message);
 }
@@ -3,37 +3,87 @@
 #include "stdafx.h"
 #include "packet.h"
 
-constexpr static uint32_t PROTOCOL_VERSION = 47;
+constexpr static uint32_t PROTOCOL_VERSION = 50;
 constexpr static uint32_t INPUT_HISTORY_LENGTH = 12;
+// A user's inputs run at most their lag (a uint8_t) past the last frame everyone has played, which is itself at most
+// our own lag past the frame we're playing, so an input queue never holds more than two lags' worth of frames
+constexpr static uint32_t INPUT_QUEUE_LENGTH = 2 * (UINT8_MAX + 1);
 
+template<typename T, size_t N>
+class ring_buffer {
+public:
+    constexpr static size_t capacity() { return N; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == N; }
+
+    T& operator[](size_t i) { return items[(head + i) % N]; }
+    const T& operator[](size_t i) const { return items[(head + i) % N]; }
+    T& front() { return (*this)[0]; }
+    const T& front() const { return (*this)[0]; }
+    T& back() { return (*this)[count - 1]; }
+    const T& back() const { return (*this)[count - 1]; }
+
+    // Drops the front element when full
+    void push_back(const T& value) {
+        if (full()) pop_front();
+        items[(head + count++) % N] = value;
+    }
+
+    void pop_front() {
+        head = (head + 1) % N;
+        count--;
+    }
+
+    void clear() {
+        head = count = 0;
+    }
+
+private:
+    std::array<T, N> items;
+    size_t head = 0;
+    size_t count = 0;
+};
+
+// The protocol schema: every message type, with the fields that follow it when sent to the server and when sent to
+// clients. Messages are sent and read through the to_server and to_client layouts generated from this list, so both
+// ends are checked against it at compile time, and receivers reject messages outside its size bounds.
+#define PACKET_TYPES(X) \
+    X(VERSION,            (not_sent),                                         (uint32_t)) \
+    X(JOIN,               (uint32_t, std::string, user_info),                 (user_info)) \
+    X(ACCEPT,             (not_sent),                                         (uint16_t, uint32_t, repeated<maybe<user_info>>)) \
+    X(PATH,               (not_sent),                                         (std::string)) \
+    X(PING,               (double),                                           (double)) \
+    X(PONG,               (double),                                           (double)) \
+    X(QUIT,               (not_sent),                                         (uint32_t)) \
+    X(NAME,               (std::string),                                      (uint32_t, std::string)) \
+    X(LATENCY,            (not_sent),                                         (repeated<double>)) \
+    X(MESSAGE,            (std::string),                                      (uint32_t, std::string)) \
+    X(LAG,                (uint8_t, bool, bool),                              (uint8_t, uint32_t, repeated<uint32_t>)) \
+    X(AUTOLAG,            (int8_t),                                           (not_sent)) \
+    X(CONTROLLERS,        (controller, controller, controller, controller),   (repeated<fields<controller, controller, controller, controller, input_map>>)) \
+    X(START,              (),                                                 ()) \
+    X(GOLF,               (bool),                                             (bool)) \
+    X(INPUT_MAP,          (input_map),                                        (uint32_t, input_map)) \
+    X(INPUT_DATA,         (var<uint32_t>, var<uint32_t>, input_window),       (var<uint32_t>, var<uint32_t>, input_window)) \
+    X(INPUT_UPDATE,       (input_data),                                       (uint32_t, input_data)) \
+    X(INPUT_RATE,         (float),                                            (not_sent)) \
+    X(REQUEST_AUTHORITY,  (uint32_t, uint32_t),                               (uint32_t, uint32_t)) \
+    X(DELEGATE_AUTHORITY, (uint32_t, uint32_t),                               (uint32_t, uint32_t))
+
+#define PACKET_TYPE_ENUM(name, server_fields, client_fields) name,
 enum packet_type : uint8_t {
-    VERSION,
-    JOIN,
-    ACCEPT,
-    PATH,
-    PING,
-    PONG,
-    QUIT,
-    NAME,
-    LATENCY,
-    MESSAGE,
-    LAG,
-    AUTOLAG,
-    CONTROLLERS,
-    START,
-    GOLF,
-    INPUT_MAP,
-    INPUT_DATA,
-    INPUT_UPDATE,
-    INPUT_RATE,
-    REQUEST_AUTHORITY,
-    DELEGATE_AUTHORITY
+    PACKET_TYPES(PACKET_TYPE_ENUM)
 };
 
+#define PACKET_TYPE_COUNT_ONE(name, server_fields, client_fields) + 1
+constexpr static size_t PACKET_TYPE_COUNT = 0 PACKET_TYPES(PACKET_TYPE_COUNT_ONE);
+
 enum query_type : uint8_t {
     SERVER_PING = 4,
     SERVER_PONG = 5,
-    EXTERNAL_ADDRESS = 21
+    EXTERNAL_ADDRESS = 21,
+    USER_DATA = 22
 };
 
 enum pak_type : int {
@@ -73,9 +123,12 @@ enum country_code : char {
     EUROPEAN_Y          = 'Y'
 };
 
+void run_service(asio::io_service& service, std::chrono::microseconds spin_budget = std::chrono::microseconds::zero());
+
 class service_wrapper {
 public:
-    service_wrapper() : work(service), thread([&] { service.run(); }) {}
+    service_wrapper(std::chrono::microseconds spin_budget = std::chrono::microseconds::zero()) :
+        work(service), thread([this, spin_budget] { run_service(service, spin_budget); }) {}
 
     template<typename F> auto run(F&& f) {
         std::packaged_task<decltype(f())(void)> task(f);
@@ -123,6 +176,11 @@ struct input_map {
         bits |= (1 << (src * 4 + dst));
     }
 
+    bool is_mapped(uint8_t src) const {
+        if (src >= 4) return false;
+        return (bits >> (src * 4)) & 0xF;
+    }
+
     void clear() {
         bits = 0;
     }
@@ -134,6 +192,11 @@ inline packet& packet::write<input_map>(const input_map& map) {
     return *this;
 }
 
+template<>
+struct encoded_size<input_map> {
+    constexpr static size_t value = 2;
+};
+
 template<>
 inline input_map packet::read<input_map>() {
     return input_map(read<uint16_t>());
@@ -166,39 +229,304 @@ struct input_data {
     }
 };
 
+template<>
+struct encoded_size<input_data> {
+    constexpr static size_t value = input_data::SIZE;
+};
+
 template<>
 inline packet& packet::write<input_data>(const input_data& input) {
+    auto dst = extend(input_data::SIZE);
     for (size_t i = 0; i < input.data.size(); i++) {
-        write(input.data[i]);
+        store(dst + i * 4, input.data[i]);
     }
-    write(input.map);
+    store(dst + 16, input.map.bits);
     return *this;
 }
 
 template<>
-inline packet& packet::write<std::list<input_data>>(const std::list<input_data>& data) {
-    for (size_t i = 0; i < 4; i++) {
-        for (auto& e : data) write(static_cast<uint8_t>(e.data[i] >> 24));
-        for (auto& e : data) write(static_cast<uint8_t>(e.data[i] >> 16));
-        for (auto& e : data) write(static_cast<uint8_t>(e.data[i] >> 8));
-        for (auto& e : data) write(static_cast<uint8_t>(e.data[i]));
-    }
-    for (auto& e : data) write(static_cast<uint8_t>(e.map.bits >> 8));
-    for (auto& e : data) write(static_cast<uint8_t>(e.map.bits));
-    return *this;
+inline bool packet_reader::read<input_data>(input_data& input) {
+    auto src = read_bytes(input_data::SIZE);
+    if (!src) return false;
+    for (size_t i = 0; i < input.data.size(); i++) {
+        input.data[i] = packet::load<uint32_t>(src + i * 4);
+    }
+    input.map = input_map(packet::load<uint16_t>(src + 16));
+    return true;
 }
 
 template<>
 inline input_data packet::read<input_data>() {
+    auto src = consume(input_data::SIZE);
     input_data input;
-    input.data[0] = read<uint32_t>();
-    input.data[1] = read<uint32_t>();
-    input.data[2] = read<uint32_t>();
-    input.data[3] = read<uint32_t>();
-    input.map = read<input_map>();
+    for (size_t i = 0; i < input.data.size(); i++) {
+        input.data[i] = load<uint32_t>(src + i * 4);
+    }
+    input.map = input_map(load<uint16_t>(src + 16));
+    return input;
+}
+
+class bit_writer {
+public:
+    bit_writer(packet& p) : p(p) { }
+
+    void write(uint32_t value, uint8_t bits) {
+        buffer = buffer << bits | (value & ((1ull << bits) - 1));
+        written += bits;
+        for (count += bits; count >= 8; count -= 8) {
+            p.push_back(static_cast<uint8_t>(buffer >> (count - 8)));
+        }
+    }
+
+    // Writes the first bits of another bit_writer's output
+    void write(const packet& src, size_t bits) {
+        size_t i = 0;
+        for (; bits >= 8; i++, bits -= 8) {
+            write(src[i], 8);
+        }
+        if (bits) {
+            write(src[i] >> (8 - bits), static_cast<uint8_t>(bits));
+        }
+    }
+
+    size_t size() const {
+        return written;
+    }
+
+    // Pads the last byte with zeros
+    void flush() {
+        if (count) p.push_back(static_cast<uint8_t>(buffer << (8 - count)));
+        count = 0;
+    }
+
+private:
+    packet& p;
+    uint64_t buffer = 0;
+    uint8_t count = 0;
+    size_t written = 0;
+};
+
+// Reads as zero bits past the end, leaving the packet_reader failed
+class bit_reader {
+public:
+    bit_reader(packet_reader& r) : r(r) { }
+
+    uint32_t read(uint8_t bits) {
+        for (; count < bits; count += 8) {
+            uint8_t byte;
+            r.read(byte);
+            buffer = buffer << 8 | byte;
+        }
+        count -= bits;
+        return static_cast<uint32_t>(buffer >> count & ((1ull << bits) - 1));
+    }
+
+    void fail() {
+        r.fail();
+    }
+
+private:
+    packet_reader& r;
+    uint64_t buffer = 0;
+    uint8_t count = 0;
+};
+
+// INPUT_DATA frames are sent as deltas. Each frame is XORed against the frame before it, or against zero for the
+// first frame of a window, and only the nonzero bytes of the ports it maps are written. Unmapped ports read as zero.
+// Per frame, packed most significant bit first and padded to a byte at the end of the window:
+//
+//   1 bit    frame changed; if not, nothing else follows
+//   1 bit    map changed, then the 16 bit map if so
+//   per port the map uses:
+//     1 bit  port changed, then a 4 bit mask of nonzero delta bytes (most significant first) and those bytes if so
+
+inline input_data mask_unmapped(input_data input) {
+    for (uint8_t i = 0; i < 4; i++) {
+        if (!input.map.is_mapped(i)) input.data[i] = 0;
+    }
     return input;
 }
 
+// Writes input as a delta from previous, which must already be masked, and returns input masked
+inline input_data write_input_delta(bit_writer& w, const input_data& input, const input_data& previous) {
+    auto current = mask_unmapped(input);
+
+    if (current.data == previous.data && current.map == previous.map) {
+        w.write(0, 1);
+        return current;
+    }
+    w.write(1, 1);
+
+    if (current.map != previous.map) {
+        w.write(1, 1);
+        w.write(current.map.bits, 16);
+    } else {
+        w.write(0, 1);
+    }
+
+    for (uint8_t i = 0; i < 4; i++) {
+        if (!current.map.is_mapped(i)) continue;
+        auto delta = current.data[i] ^ previous.data[i];
+        if (!delta) {
+            w.write(0, 1);
+            continue;
+        }
+        uint8_t mask = 0;
+        for (uint8_t b = 0; b < 4; b++) {
+            if (delta >> (24 - b * 8) & 0xFF) mask |= 8 >> b;
+        }
+        w.write(1, 1);
+        w.write(mask, 4);
+        for (uint8_t b = 0; b < 4; b++) {
+            if (mask & (8 >> b)) w.write(delta >> (24 - b * 8), 8);
+        }
+    }
+
+    return current;
+}
+
+inline input_data read_input_delta(bit_reader& r, const input_data& previous) {
+    auto current = previous;
+    if (!r.read(1)) return current;
+
+    if (r.read(1)) {
+        current.map = input_map(static_cast<uint16_t>(r.read(16)));
+    }
+
+    for (uint8_t i = 0; i < 4; i++) {
+        if (!current.map.is_mapped(i)) {
+            current.data[i] = 0;
+            continue;
+        }
+        if (!r.read(1)) continue;
+        auto mask = r.read(4);
+        if (!mask) {
+            r.fail();
+            break;
+        }
+        for (uint8_t b = 0; b < 4; b++) {
+            if (mask & (8 >> b)) current.data[i] ^= r.read(8) << (24 - b * 8);
+        }
+    }
+
+    return current;
+}
+
+// The last INPUT_HISTORY_LENGTH frames, each with its delta from the frame before it
+class input_history_buffer {
+public:
+    constexpr static size_t N = INPUT_HISTORY_LENGTH;
+
+    constexpr static size_t capacity() { return N; }
+    size_t size() const { return frames.size(); }
+    bool empty() const { return frames.empty(); }
+    bool full() const { return frames.full(); }
+
+    const input_data& operator[](size_t i) const { return frames[i]; }
+    const input_data& front() const { return frames.front(); }
+    const input_data& back() const { return frames.back(); }
+
+    // Drops the front frame when full
+    void push_back(const input_data& input) {
+        frames.push_back(input);
+
+        // Encode the frame's delta from the one before it once, so windows are assembled from cached bits
+        auto slot = pushed++ % N;
+        auto& delta = deltas[slot];
+        delta.clear();
+        bit_writer w(delta);
+        last = write_input_delta(w, input, last);
+        delta_bits[slot] = w.size();
+        w.flush();
+    }
+
+    // Writes the cached delta of frame i from frame i - 1
+    void write_delta(bit_writer& w, size_t i) const {
+        auto slot = (pushed - size() + i) % N;
+        w.write(deltas[slot], delta_bits[slot]);
+    }
+
+    void pop_front() {
+        frames.pop_front();
+    }
+
+    void clear() {
+        frames.clear();
+    }
+
+private:
+    ring_buffer<input_data, N> frames;
+    std::array<packet, N> deltas;
+    std::array<size_t, N> delta_bits;
+    input_data last = input_data(); // The newest frame, masked
+    size_t pushed = 0;
+};
+
+class input_queue_buffer : public ring_buffer<input_data, INPUT_QUEUE_LENGTH> {
+public:
+    // Queued inputs are never dropped, so this returns false when full: the peer broke the lag bound
+    bool push_back(const input_data& input) {
+        if (full()) return false;
+        ring_buffer::push_back(input);
+        return true;
+    }
+};
+
+// Moves past a frame's delta, keeping track of the map the next frame is encoded against
+inline void skip_input_delta(bit_reader& r, input_map& map) {
+    if (!r.read(1)) return;
+
+    if (r.read(1)) {
+        map = input_map(static_cast<uint16_t>(r.read(16)));
+    }
+
+    for (uint8_t i = 0; i < 4; i++) {
+        if (!map.is_mapped(i) || !r.read(1)) continue;
+        auto mask = r.read(4);
+        if (!mask) return r.fail();
+        r.read(static_cast<uint8_t>(((mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1) + (mask >> 3)) * 8));
+    }
+}
+
+struct input_window { }; // Message field written by write_input_window
+
+template<>
+struct field_size<input_window> {
+    constexpr static bool fixed = false;
+    constexpr static size_t min = 1;
+    constexpr static size_t max = packet::MAX_SIZE;
+};
+
+// Writes frames [first, size) of the history as a window: the frame count, then the frames as deltas
+inline packet& write_input_window(packet& p, const input_history_buffer& history, size_t first = 0) {
+    p.write_var(history.size() - first);
+    bit_writer w(p);
+    if (first < history.size()) {
+        write_input_delta(w, history[first], input_data());
+        for (size_t i = first + 1; i < history.size(); i++) {
+            history.write_delta(w, i);
+        }
+    }
+    w.flush();
+    return p;
+}
+
+// Calls on_input with each frame of a window, and returns the frame count. Stops at the first malformed frame.
+template<typename F>
+inline uint32_t read_input_window(packet_reader& r, F on_input) {
+    uint32_t count;
+    if (!r.read_var(count)) return 0;
+    if (count > r.available() * 8) return r.fail();
+    bit_reader b(r);
+    auto input = input_data();
+    for (uint32_t i = 0; i < count; i++) {
+        input = read_input_delta(b, input);
+        if (!r) return 0;
+        on_input(input);
+    }
+    return count;
+}
+
 struct rom_info {
     uint32_t crc1 = 0;
     uint32_t crc2 = 0;
@@ -269,20 +597,27 @@ struct controller {
     int plugin = pak_type::NONE;
 };
 
+template<>
+struct encoded_size<controller> {
+    constexpr static size_t value = 12;
+};
+
 template<>
 inline packet& packet::write<controller>(const controller& c) {
-    write(c.present);
-    write(c.raw_data);
-    write(c.plugin);
+    auto dst = extend(12);
+    store(dst, static_cast<uint32_t>(c.present));
+    store(dst + 4, static_cast<uint32_t>(c.raw_data));
+    store(dst + 8, static_cast<uint32_t>(c.plugin));
     return *this;
 }
 
 template<>
 inline controller packet::read<controller>() {
+    auto src = consume(12);
     controller c;
-    c.present = read<int>();
-    c.raw_data = read<int>();
-    c.plugin = read<pak_type>();
+    c.present = static_cast<int>(load<uint32_t>(src));
+    c.raw_data = static_cast<int>(load<uint32_t>(src + 4));
+    c.plugin = static_cast<int>(load<uint32_t>(src + 8));
     return c;
 }
 
@@ -299,20 +634,54 @@ struct user_info {
 
     input_data input = input_data();
     input_data pending = input_data();
-    std::list<input_data> input_queue;
-    std::list<input_data> input_history;
+    input_queue_buffer input_queue;
+    input_history_buffer input_history;
     uint32_t input_id = 0;
     bool has_authority = false;
 
     bool add_input_history(uint32_t input_id, const input_data& input) {
         if (input_id != this->input_id) return false;
         input_history.push_back(input);
-        while (input_history.size() > INPUT_HISTORY_LENGTH) {
-            input_history.pop_front();
-        }
         this->input_id++;
         return true;
     }
+
+    bool get_input_history(uint32_t input_id, input_data& input) const {
+        if (input_id >= this->input_id || this->input_id - input_id > input_history.size()) return false;
+        input = input_history[input_history.size() - (this->input_id - input_id)];
+        return true;
+    }
+
+    // Adds the frames of a window that are past input_id, calling on_input with each one. A window with nothing new
+    // is left undecoded, and the frames we already have are skipped over rather than decoded.
+    // A malformed window leaves r failed, with the frames before the fault already added.
+    template<typename F>
+    void add_input_window(packet_reader& r, uint32_t start_id, F on_input) {
+        uint32_t count;
+        if (!r.read_var(count)) return;
+        if (count > r.available() * 8) {
+            r.fail();
+            return;
+        }
+        if (start_id > input_id || start_id + count <= input_id) return;
+
+        bit_reader b(r);
+        auto input = input_data();
+        if (start_id < input_id) {
+            auto map = input_map();
+            for (auto i = start_id; i < input_id; i++) {
+                skip_input_delta(b, map);
+            }
+            if (!r) return;
+            input = mask_unmapped(input_history.back());
+        }
+        for (auto i = input_id; i < start_id + count; i++) {
+            input = read_input_delta(b, input);
+            if (!r) return;
+            add_input_history(i, input);
+            on_input(input);
+        }
+    }
 };
 
 template<>
@@ -350,6 +719,59 @@ inline user_info packet::read<user_info>() {
     return info;
 }
 
+template<>
+struct field_size<rom_info> : fields<uint32_t, uint32_t, std::string, char, uint8_t> { };
+
+template<>
+struct field_size<user_info> : fields<uint32_t, uint32_t, std::string, rom_info, uint8_t, double, controller, controller, controller, controller, input_map, bool> { };
+
+// Message layouts generated from PACKET_TYPES
+template<packet_type Type>
+struct to_server;
+
+template<packet_type Type>
+struct to_client;
+
+#define PACKET_FIELDS(...) fields<__VA_ARGS__>
+#define PACKET_TYPE_LAYOUTS(name, server_fields, client_fields) \
+    template<> struct to_server<name> { constexpr static packet_type type = name; typedef PACKET_FIELDS server_fields layout; }; \
+    template<> struct to_client<name> { constexpr static packet_type type = name; typedef PACKET_FIELDS client_fields layout; };
+PACKET_TYPES(PACKET_TYPE_LAYOUTS)
+
+struct message_bounds {
+    size_t min;
+    size_t max;
+};
+
+#define PACKET_TYPE_SERVER_BOUNDS(name, server_fields, client_fields) { PACKET_FIELDS server_fields::min, PACKET_FIELDS server_fields::max },
+#define PACKET_TYPE_CLIENT_BOUNDS(name, server_fields, client_fields) { PACKET_FIELDS client_fields::min, PACKET_FIELDS client_fields::max },
+constexpr static message_bounds TO_SERVER_BOUNDS[] = { PACKET_TYPES(PACKET_TYPE_SERVER_BOUNDS) };
+constexpr static message_bounds TO_CLIENT_BOUNDS[] = { PACKET_TYPES(PACKET_TYPE_CLIENT_BOUNDS) };
+
+// Whether a message, type included, has a known type and a size within the bounds of its layout
+inline bool in_bounds(const message_bounds* bounds, const uint8_t* data, size_t size) {
+    if (size == 0 || data[0] >= PACKET_TYPE_COUNT) return false;
+    auto& b = bounds[data[0]];
+    return size - 1 >= b.min && size - 1 <= b.max;
+}
+
+// Reads the fields of a message, checked at compile time against its layout
+template<typename Message, typename... T>
+void read_message(packet& p, T&... values) {
+    static_assert(std::is_same<fields<T...>, typename Message::layout>::value, "Fields don't match the message layout");
+    int expand[] = { 0, (p >> values, 0)... };
+    (void)expand;
+}
+
+template<typename Message, typename... T>
+bool read_message(packet_reader& r, T&... values) {
+    static_assert(std::is_same<fields<T...>, typename Message::layout>::value, "Fields don't match the message layout");
+    bool result = true;
+    int expand[] = { 0, (result = r.read(values) && result, 0)... };
+    (void)expand;
+    return result;
+}
+
 template<typename InternetProtocol>
 std::string endpoint_to_string(const asio::ip::basic_endpoint<InternetProtocol>& endpoint, bool include_port = false) {
     std::string result;
@@ -6,8 +6,145 @@
 using namespace std;
 using namespace asio;
 
+atomic<uint64_t> connection::udp_syscall_count(0);
+
+size_t receive_datagrams(ip::udp::socket& socket, vector<datagram>& datagrams, size_t max_size, error_code& error) {
+#ifdef __linux__
+    constexpr size_t MAX_BATCH_SIZE = 64;
+    array<mmsghdr, MAX_BATCH_SIZE> msgs;
+    array<iovec, MAX_BATCH_SIZE> iovs;
+    struct control {
+        alignas(cmsghdr) uint8_t data[CMSG_SPACE(sizeof(timespec))];
+    };
+    array<control, MAX_BATCH_SIZE> controls; // Room for an SO_TIMESTAMPNS receive time
+    size_t count = min(datagrams.size(), MAX_BATCH_SIZE);
+    for (size_t i = 0; i < count; i++) {
+        auto& d = datagrams[i];
+        d.data.resize(max_size);
+        iovs[i] = { d.data.data(), d.data.size() };
+        msgs[i] = {};
+        msgs[i].msg_hdr.msg_name = d.endpoint.data();
+        msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(d.endpoint.capacity());
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i].data;
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].data);
+    }
+    connection::udp_syscall_count++;
+    int n = recvmmsg(socket.native_handle(), msgs.data(), static_cast<unsigned int>(count), MSG_DONTWAIT, nullptr);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error = error_code(errno, asio::error::get_system_category());
+        }
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        auto& d = datagrams[i];
+        d.endpoint.resize(msgs[i].msg_hdr.msg_namelen);
+        d.data.resize(msgs[i].msg_hdr.msg_flags & MSG_TRUNC ? 0 : msgs[i].msg_len);
+        d.data.rewind();
+        d.received = std::chrono::system_clock::time_point();
+        for (auto c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c; c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) continue;
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            d.received = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+        }
+    }
+    return n;
+#else
+    size_t count = 0;
+    for (; count < datagrams.size(); count++) {
+        connection::udp_syscall_count++;
+        size_t size = socket.available(error);
+        if (error || size == 0) break;
+        auto& d = datagrams[count];
+        d.data.resize(max(size, max_size));
+        connection::udp_syscall_count++;
+        size = socket.receive_from(buffer(d.data.data(), d.data.size()), d.endpoint, 0, error);
+        if (error) break;
+        d.data.resize(size > max_size ? 0 : size);
+        d.data.rewind();
+    }
+    return count;
+#endif
+}
+
+void send_datagrams(ip::udp::socket& socket, const datagram* datagrams, size_t count, error_code& error) {
+#ifdef __linux__
+    constexpr size_t MAX_BATCH_SIZE = 64;
+    array<mmsghdr, MAX_BATCH_SIZE> msgs;
+    array<iovec, MAX_BATCH_SIZE> iovs;
+    while (count > 0) {
+        size_t batch = min(count, MAX_BATCH_SIZE);
+        for (size_t i = 0; i < batch; i++) {
+            auto& d = datagrams[i];
+            iovs[i] = { const_cast<uint8_t*>(d.data.data()), d.data.size() };
+            msgs[i] = {};
+            if (d.endpoint.port()) {
+                msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>(d.endpoint.data());
+                msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(d.endpoint.size());
+            }
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        connection::udp_syscall_count++;
+        int n = sendmmsg(socket.native_handle(), msgs.data(), static_cast<unsigned int>(batch), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            error = error_code(errno, asio::error::get_system_category());
+            n = 1; // Skip the datagram that failed
+        }
+        datagrams += n;
+        count -= n;
+    }
+#else
+    for (size_t i = 0; i < count; i++) {
+        auto& d = datagrams[i];
+        error_code ec;
+        connection::udp_syscall_count++;
+        if (d.endpoint.port()) {
+            socket.send_to(buffer(d.data.data(), d.data.size()), d.endpoint, 0, ec);
+        } else {
+            socket.send(buffer(d.data.data(), d.data.size()), 0, ec);
+        }
+        if (ec) error = ec;
+    }
+#endif
+}
+
 connection::connection(asio::io_service& service) :
-    udp_resolver(service), tcp_socket(make_shared<ip::tcp::socket>(service)), udp_socket(make_shared<ip::udp::socket>(service)) { }
+    my_service(&service), udp_resolver(service), tcp_socket(make_shared<ip::tcp::socket>(service)), udp_socket(make_shared<ip::udp::socket>(service)) { }
+
+asio::io_service& connection::get_service() {
+    return *my_service;
+}
+
+void connection::move_to(asio::io_service& service, error_code& error) {
+    if (tcp_socket && tcp_socket->is_open()) {
+        tcp_write_moved = flushing; // Its completion puts the unsent bytes back in tcp_output for flush to pick up on the new service
+        auto protocol = tcp_socket->local_endpoint(error).protocol();
+        if (error) return;
+        auto handle = tcp_socket->release(error);
+        if (error) return;
+        tcp_socket = make_shared<ip::tcp::socket>(service);
+        tcp_socket->assign(protocol, handle, error);
+        if (error) return;
+    }
+
+    if (udp_socket && udp_socket->is_open()) {
+        auto protocol = udp_socket->local_endpoint(error).protocol();
+        if (error) return;
+        auto handle = udp_socket->release(error);
+        if (error) return;
+        udp_socket = make_shared<ip::udp::socket>(service);
+        udp_socket->assign(protocol, handle, error);
+        if (error) return;
+    }
+
+    my_service = &service;
+}
 
 bool connection::is_open() {
     return tcp_socket && tcp_socket->is_open();
@@ -20,7 +157,13 @@ void connection::close(const error_code& error) {
         tcp_socket->close(ec);
     }
     tcp_socket.reset();
-    tcp_output_buffer.clear();
+    tcp_output.clear();
+    tcp_writing = make_shared<output_buffer>();
+    flushing = false;
+    tcp_write_moved = false;
+    congested = false;
+    overflowed = false;
+    tcp_input_start = tcp_input_end = 0;
 
     close_udp();
     on_error(error);
@@ -33,208 +176,419 @@ void connection::close_udp() {
         udp_socket->close(ec);
     }
     udp_socket.reset();
+    udp_header.clear();
     udp_output_buffer.clear();
+    udp_output_count = 0;
     udp_established = false;
 }
 
 void connection::send(const packet& packet, bool flush) {
-    if (!tcp_socket || !tcp_socket->is_open()) return;
+    if (!start_message(packet.size())) return;
 
-    tcp_output_buffer << packet;
+    tcp_output.data.insert(tcp_output.data.end(), packet.begin(), packet.end());
 
     if (flush) {
         this->flush();
     }
 }
 
-void connection::send_udp(const packet& packet, bool flush) {
-    if (!udp_socket || !udp_socket->is_open()) return;
+void connection::send(const shared_ptr<const packet>& packet, bool flush) {
+    if (!start_message(packet->size())) return;
 
-    size_t size = (packet.size() < 0x80 ? 1 : (packet.size() < 0x4000 ? 2 : 3)) + packet.size();
-    if (size > MAX_UDP_SIZE) return;
+    tcp_output.shared.emplace_back(tcp_output.data.size(), packet);
+    tcp_output.shared_size += packet->size();
 
-    if (udp_output_buffer.size() + size > MAX_UDP_SIZE) {
-        this->flush_udp();
+    if (flush) {
+        this->flush();
+    }
+}
+
+void connection::send_latest(const shared_ptr<const packet>& packet, uint32_t id) {
+    if (packet->empty()) return send(packet);
+
+    auto type = (*packet)[0];
+    auto latest = find_latest(type, id, packet->size(), true);
+    if (latest) {
+        tcp_output.shared[latest->shared_index].second = packet;
+        superseded_count++;
+        return;
+    }
+
+    if (!start_message(packet->size())) return;
+    set_latest(type, id, packet->size(), tcp_output.shared.size());
+    tcp_output.shared.emplace_back(tcp_output.data.size(), packet);
+    tcp_output.shared_size += packet->size();
+    flush();
+}
+
+// Finds a queued message that a new one of the same size can replace, which is only done while the output is congested
+connection::output_buffer::latest_message* connection::find_latest(uint8_t type, uint32_t id, size_t size, bool shared) {
+    if (!congested) return nullptr;
+    for (auto& m : tcp_output.latest) {
+        if (m.type != type || m.id != id) continue;
+        if (m.size != size || (m.shared_index != SIZE_MAX) != shared) return nullptr;
+        return &m;
+    }
+    return nullptr;
+}
+
+void connection::set_latest(uint8_t type, uint32_t id, size_t size, size_t shared_index) {
+    output_buffer::latest_message message = { type, id, tcp_output.data.size(), size, shared_index };
+    for (auto& m : tcp_output.latest) {
+        if (m.type != type || m.id != id) continue;
+        m = message;
+        return;
     }
+    tcp_output.latest.push_back(message);
+}
 
-    udp_output_buffer << packet;
+void connection::send_udp(const packet& packet, bool flush) {
+    if (!start_udp_message(packet.size())) return;
+
+    udp_output_buffer.insert(udp_output_buffer.end(), packet.begin(), packet.end());
 
     if (flush) {
         this->flush_udp();
     }
 }
 
-void connection::flush() {
-    if (!tcp_socket || !tcp_socket->is_open()) return;
+// Writes the length prefix of a size byte message to the output buffer, or returns false if it can't be sent
+bool connection::start_message(size_t size) {
+    if (!tcp_socket || !tcp_socket->is_open()) return false;
 
-    if (tcp_output_buffer.empty()) return;
-    if (flushing) return;
+    auto depth = get_output_queue_depth() + size;
+    if (depth > limits.hard_limit) {
+        on_output_overflow();
+        return false;
+    }
+    if (depth > limits.high_watermark) {
+        congested = true;
+    }
+    peak_output_queue_depth = max(peak_output_queue_depth, depth);
+
+    tcp_output.data.write_var(size);
+    return true;
+}
 
-    auto p(make_shared<packet>());
-    p->swap(tcp_output_buffer);
-    flushing = true;
+// The peer has stopped reading, so drop it. Closing is deferred since this can be reached while iterating the room's users
+void connection::on_output_overflow() {
+    if (overflowed) return;
+    overflowed = true;
 
     auto t(tcp_socket);
     auto s(weak_from_this());
-    async_write(*t, buffer(*p), [this, t, p, s](const error_code& error, size_t transferred) {
+    my_service->post([this, t, s] {
         if (s.expired() || t != tcp_socket) return;
-        if (error) return close(error);
-        flushing = false;
-        flush();
+        close(asio::error::no_buffer_space);
     });
 }
 
-void connection::flush_udp() {
-    if (!udp_socket || !udp_socket->is_open()) return;
+void connection::set_output_limits(const output_limits& limits) {
+    this->limits = limits;
+}
 
-    if (udp_output_buffer.empty()) return;
+// Bytes queued for TCP, including those being written
+size_t connection::get_output_queue_depth() const {
+    return tcp_output.size() + (flushing ? tcp_writing->size() : 0);
+}
 
-    error_code error;
-    udp_socket->send(buffer(udp_output_buffer), 0, error);
-    udp_output_buffer.clear();
-    if (error) close_udp();
+bool connection::is_congested() const {
+    return congested;
 }
 
-void connection::flush_all() {
-    flush();
-    flush_udp();
+bool connection::start_udp_message(size_t size) {
+    if (!is_udp_open()) return false;
+
+    size_t total = (size < 0x80 ? 1 : (size < 0x4000 ? 2 : 3)) + size;
+    if (udp_header.size() + total > MAX_UDP_SIZE) return false;
+
+    if (udp_output_buffer.size() + total > MAX_UDP_SIZE) {
+        queue_udp();
+    }
+
+    if (udp_output_buffer.empty()) {
+        udp_output_buffer.insert(udp_output_buffer.end(), udp_header.begin(), udp_header.end());
+    }
+    udp_output_buffer.write_var(size);
+    return true;
 }
 
-void connection::query_udp_port(std::function<void()> handler) {
-    auto handled = make_shared<bool>(false);
-    auto handle = [handler, handled]() {
-        if (!*handled) {
-            *handled = true;
-            handler();
+void connection::flush() {
+    if (!tcp_socket || !tcp_socket->is_open()) return;
+
+    if (tcp_output.data.empty()) return;
+    if (flushing) return;
+
+    tcp_writer = asio::coroutine();
+    write_tcp();
+}
+
+// Writes the output buffer until it stays empty, gathering each batch of queued messages into as few writes as the socket takes
+void connection::write_tcp(const error_code& error, size_t transferred) {
+    ASIO_CORO_REENTER(tcp_writer) {
+        while (!tcp_output.data.empty()) {
+            flushing = true;
+            prepare_write();
+            while (!tcp_writing->buffers.empty()) {
+                ASIO_CORO_YIELD tcp_socket->async_write_some(tcp_writing->buffers, resume{ &connection::write_tcp, this, weak_from_this(), tcp_socket, tcp_writing, io_memory });
+                tcp_writing->consume(transferred);
+                if (tcp_write_moved) return requeue_write();
+                if (error) return close(error);
+            }
+            tcp_writing->clear();
+            if (congested && get_output_queue_depth() < limits.low_watermark) {
+                congested = false;
+            }
         }
-    };
+        flushing = false;
+    }
+}
 
-    if (!tcp_socket || !udp_socket) {
-        external_udp_port = 0;
-        return handle();
+// Puts what's left of a write interrupted by move_to back in front of the output buffer
+void connection::requeue_write() {
+    packet unsent;
+    for (auto& b : tcp_writing->buffers) {
+        auto data = static_cast<const uint8_t*>(b.data());
+        unsent.insert(unsent.end(), data, data + b.size());
+    }
+    auto offset = unsent.size();
+    unsent.insert(unsent.end(), tcp_output.data.begin(), tcp_output.data.end());
+    tcp_output.data.swap(unsent);
+    for (auto& e : tcp_output.shared) {
+        e.first += offset;
+    }
+    for (auto& m : tcp_output.latest) {
+        m.offset += offset;
     }
 
-    external_udp_port = udp_socket->local_endpoint().port();
+    tcp_writing->clear();
+    tcp_write_moved = false;
+    flushing = false;
+}
 
-    auto local_addr = tcp_socket->local_endpoint().address();
-    auto remote_addr = tcp_socket->remote_endpoint().address();
-    if (!is_private_address(local_addr) || is_private_address(remote_addr)) {
-        return handle();
+void connection::prepare_write() {
+    auto& w = *tcp_writing;
+    w.data.swap(tcp_output.data);
+    w.shared.swap(tcp_output.shared);
+    swap(w.shared_size, tcp_output.shared_size);
+    tcp_output.latest.clear(); // Messages being written can't be replaced anymore
+
+    size_t offset = 0;
+    for (auto& e : w.shared) {
+        if (e.first > offset) {
+            w.buffers.emplace_back(w.data.data() + offset, e.first - offset);
+        }
+        w.buffers.emplace_back(e.second->data(), e.second->size());
+        offset = e.first;
+    }
+    if (offset < w.data.size()) {
+        w.buffers.emplace_back(w.data.data() + offset, w.data.size() - offset);
     }
+}
 
-    auto u(udp_socket);
-    auto s(weak_from_this());
-    udp_resolver.async_resolve(udp_socket->local_endpoint().protocol(), "query.play64.com", "6400", [=](const auto& error, auto iterator) {
-        if (s.expired() || u != udp_socket) return handle();
-        if (error) return handle();
-        auto p(make_shared<packet>());
-        *p << EXTERNAL_ADDRESS;
-        udp_socket->async_send_to(buffer(*p), iterator->endpoint(), [=](const error_code& error, size_t transferred) {
-            if (s.expired() || u != udp_socket) return handle();
-            p->reset();
-            if (error) return handle();
-
-            auto timer = make_shared<asio::steady_timer>(udp_resolver.get_executor());
-            timer->expires_after(std::chrono::seconds(1));
-
-            udp_socket->async_wait(ip::udp::socket::wait_read, [=](const error_code& error) {
-                if (s.expired() || u != udp_socket) return handle();
-                timer->cancel();
-                if (error) return handle();
-                error_code ec;
-                p->resize(udp_socket->available(ec));
-                if (ec) return handle();
-                p->resize(udp_socket->receive(buffer(*p), 0, ec));
-                if (ec) return handle();
-                if (p->available() < sizeof(query_type) || p->read<query_type>() != EXTERNAL_ADDRESS) return handle();
-                if (p->available() < sizeof(uint16_t)) return handle();
-                external_udp_port = p->read<uint16_t>();
-                return handle();
-            });
-
-            timer->async_wait([this, s, u, timer, handle](const asio::error_code& error) {
-                if (s.expired() || u != udp_socket) return handle();
-                if (error) return handle();
-                udp_socket->close();
-            });
-        });
-    });
+void connection::resume::operator()(const error_code& error, size_t transferred) const {
+    if (self.expired()) return;
+    // Writes finish on the buffer they started with, even if move_to replaced the socket, so no sent bytes are lost track of
+    if (socket != c->tcp_socket && socket != c->udp_socket && (!data || data != c->tcp_writing)) return;
+    (c->*step)(error, transferred);
+}
+
+size_t connection::output_buffer::size() const {
+    return data.size() + shared_size;
+}
+
+void connection::output_buffer::consume(size_t size) {
+    auto it = buffers.begin();
+    for (; it != buffers.end() && size >= it->size(); ++it) {
+        size -= it->size();
+    }
+    buffers.erase(buffers.begin(), it);
+    if (size > 0) {
+        buffers.front() += size;
+    }
 }
 
+void connection::output_buffer::clear() {
+    data.clear();
+    shared.clear();
+    buffers.clear();
+    shared_size = 0;
+    latest.clear();
+}
 
-void connection::receive_tcp_packet_size(function<void(size_t)> handler, size_t value, int count) {
+void connection::queue_udp() {
+    if (udp_output_buffer.empty()) return;
+
+    if (udp_output_count == udp_output_queue.size()) {
+        udp_output_queue.emplace_back();
+    }
+    udp_output_queue[udp_output_count++].data.swap(udp_output_buffer);
+    udp_output_buffer.clear();
+}
+
+void connection::flush_udp() {
+    if (!is_udp_open()) return;
+
+    queue_udp();
+    if (udp_output_count == 0) return;
+
+    write_udp(udp_output_queue.data(), udp_output_count);
+    udp_output_count = 0;
+}
+
+bool connection::is_udp_open() {
+    return udp_socket && udp_socket->is_open();
+}
+
+void connection::write_udp(datagram* datagrams, size_t count) {
+    error_code error;
+    send_datagrams(*udp_socket, datagrams, count, error);
+    if (error) close_udp();
+}
+
+void connection::flush_all() {
+    flush();
+    flush_udp();
+}
+
+void connection::receive_tcp_packet() {
     if (!tcp_socket || !tcp_socket->is_open()) return;
-    auto b = make_shared<uint8_t>();
-    auto t(tcp_socket);
-    auto s(weak_from_this());
-    async_read(*t, buffer(b.get(), 1), [=](const error_code& error, size_t transferred) {
-        if (s.expired() || t != tcp_socket) return;
-        if (error) return close(error);
-        auto size = value | (static_cast<size_t>(*b & 0b01111111) << (count * 7));
-        if (*b & 0b10000000) {
-            receive_tcp_packet_size(handler, size, count + 1);
-        } else {
-            handler(size);
+
+    tcp_reader = asio::coroutine();
+    read_tcp();
+}
+
+void connection::read_tcp(const error_code& error, size_t transferred) {
+    ASIO_CORO_REENTER(tcp_reader) {
+        for (;;) {
+            if (!receive_tcp_frames()) return;
+            ASIO_CORO_YIELD tcp_socket->async_read_some(buffer(tcp_input_buffer.data() + tcp_input_end, tcp_input_buffer.size() - tcp_input_end), resume{ &connection::read_tcp, this, weak_from_this(), tcp_socket, nullptr, io_memory });
+            if (error) return close(error);
+            tcp_input_end += transferred;
         }
-    });
+    }
 }
 
-void connection::receive_tcp_packet() {
-    receive_tcp_packet_size([=](size_t size) {
-        if (!tcp_socket || !tcp_socket->is_open()) return;
-        if (size == 0) return receive_tcp_packet();
-        if (size > packet::MAX_SIZE) {
+// Dispatches every complete frame that is already buffered and makes room for the next read. Returns false if the socket was closed or replaced
+bool connection::receive_tcp_frames() {
+    auto t(tcp_socket);
+    auto s(weak_from_this());
+
+    constexpr size_t MAX_SIZE_BYTES = 3; // Varint bytes needed for packet::MAX_SIZE
+
+    while (tcp_input_start < tcp_input_end) {
+        size_t size = 0;
+        size_t header = 0;
+        bool complete = false;
+        while (!complete && header < MAX_SIZE_BYTES && tcp_input_start + header < tcp_input_end) {
+            auto byte = tcp_input_buffer[tcp_input_start + header];
+            size |= static_cast<size_t>(byte & 0b01111111) << (header++ * 7);
+            complete = !(byte & 0b10000000);
+        }
+        if (size > packet::MAX_SIZE || (!complete && header == MAX_SIZE_BYTES)) {
             log(cerr, "packet too large");
-            return close();
+            close();
+            return false;
         }
-        auto p(make_shared<packet>(size));
-        auto t(tcp_socket);
-        auto s(weak_from_this());
-        async_read(*t, buffer(*p), [=](const error_code& error, size_t transferred) {
-            if (s.expired() || t != tcp_socket) return;
-            if (error) return close(error);
-            try {
-                on_receive(*p, false);
-            } catch (const exception& e) {
-                log(cerr, e.what());
-                return close();
-            } catch (const error_code& e) {
-                return close(e);
-            }
-            receive_tcp_packet();
-        });
-    });
+        if (!complete) break;
+        if (tcp_input_end - tcp_input_start - header < size) break;
+
+        auto begin = tcp_input_buffer.data() + tcp_input_start + header;
+        tcp_input_start += header + size;
+        if (size == 0) continue;
+        try {
+            receive_message(begin, size, tcp_input_packet, false);
+        } catch (const exception& e) {
+            log(cerr, e.what());
+            close();
+            return false;
+        } catch (const error_code& e) {
+            close(e);
+            return false;
+        }
+        if (s.expired() || t != tcp_socket) return false;
+    }
+
+    // Move the partial frame to the front and make sure the largest possible frame fits
+    if (tcp_input_start > 0) {
+        copy(tcp_input_buffer.begin() + tcp_input_start, tcp_input_buffer.begin() + tcp_input_end, tcp_input_buffer.begin());
+        tcp_input_end -= tcp_input_start;
+        tcp_input_start = 0;
+    }
+    if (tcp_input_end == tcp_input_buffer.size()) {
+        tcp_input_buffer.resize(max(TCP_BUFFER_SIZE, min(tcp_input_buffer.size() * 2, MAX_SIZE_BYTES + packet::MAX_SIZE)));
+    }
+    return true;
 }
 
 void connection::receive_udp_packet() {
     if (!udp_socket || !udp_socket->is_open()) return;
+    if (udp_input_buffers.empty()) {
+        udp_input_buffers.resize(UDP_BATCH_SIZE);
+    }
+
+    udp_reader = asio::coroutine();
+    read_udp();
+}
+
+void connection::read_udp(const error_code& error, size_t) {
+    ASIO_CORO_REENTER(udp_reader) {
+        for (;;) {
+            ASIO_CORO_YIELD udp_socket->async_wait(ip::udp::socket::wait_read, resume{ &connection::read_udp, this, weak_from_this(), udp_socket, nullptr, io_memory });
+            if (error) return close_udp();
+            if (!receive_udp_batch()) return;
+        }
+    }
+}
+
+// Drains the UDP socket in batches. Returns false if the socket was closed or replaced
+bool connection::receive_udp_batch() {
     auto u(udp_socket);
-    auto s(weak_from_this());
-    u->async_wait(ip::udp::socket::wait_read, [=](const error_code& error) {
-        if (s.expired() || u != udp_socket) return;
-        if (error) return close_udp();
-        error_code ec;
-        while (size_t size = udp_socket->available(ec)) {
-            if (ec) return close_udp();
-            packet buf(size);
-            ip::udp::endpoint ep;
-            size = udp_socket->receive_from(buffer(buf), ep, 0, ec);
-            if (ec) return close_udp();
-            if (ep != udp_socket->remote_endpoint()) continue;
-            buf.resize(size);
-            while (buf.available()) {
-                try {
-                    packet p;
-                    buf.read(p);
-                    if (p.empty()) continue;
-                    on_receive(p, true);
-                } catch (const exception&) {
-                    return close_udp();
-                } catch (const error_code&) {
-                    return close_udp();
-                }
-            }
+    error_code ec;
+    size_t count;
+    do {
+        count = receive_datagrams(*udp_socket, udp_input_buffers, MAX_UDP_SIZE, ec);
+        if (ec) {
+            close_udp();
+            return false;
         }
-        receive_udp_packet();
-    });
+        for (size_t i = 0; i < count; i++) {
+            receive_datagram(udp_input_buffers[i].data);
+            if (u != udp_socket) return false;
+        }
+    } while (count == udp_input_buffers.size());
+    return true;
+}
+
+void connection::receive_datagram(packet& datagram) {
+    packet_reader r(datagram);
+    while (r.available()) {
+        size_t size;
+        if (!r.read_var(size) || size > packet::MAX_SIZE) return close_udp();
+        auto body = r.read_bytes(size);
+        if (!body) return close_udp();
+        if (size == 0) continue;
+        try {
+            receive_message(body, size, udp_input_packet, true);
+        } catch (const exception&) {
+            return close_udp();
+        } catch (const error_code&) {
+            return close_udp();
+        }
+        if (!is_udp_open()) return;
+    }
+}
+
+void connection::receive_message(const uint8_t* data, size_t size, packet& buffer, bool udp) {
+    if (receive_bounds && !in_bounds(receive_bounds, data, size)) return on_malformed(udp);
+    if (on_receive(packet_reader(data, size), udp)) return;
+    buffer.assign(data, data + size);
+    buffer.rewind();
+    on_receive(buffer, udp);
+}
+
+void connection::on_malformed(bool udp) {
+    if (udp) return close_udp();
+    log(cerr, "malformed packet");
+    close();
 }
\ No newline at end of file
@@ -4,37 +4,321 @@
 
 #include "packet.h"
 
+struct message_bounds;
+
+struct datagram {
+    asio::ip::udp::endpoint endpoint;
+    packet data;
+    std::chrono::system_clock::time_point received; // When the kernel received it, if the socket reports that
+};
+
+size_t receive_datagrams(asio::ip::udp::socket& socket, std::vector<datagram>& datagrams, size_t max_size, std::error_code& error);
+void send_datagrams(asio::ip::udp::socket& socket, const datagram* datagrams, size_t count, std::error_code& error);
+
+// A few fixed slots for completion handlers, so steady state reads and writes don't allocate
+class handler_memory {
+public:
+    void* allocate(size_t size) {
+        if (size <= SLOT_SIZE) {
+            for (auto& s : slots) {
+                if (s.used) continue;
+                s.used = true;
+                return &s.storage;
+            }
+        }
+        allocation_count()++;
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+        for (auto& s : slots) {
+            if (pointer != &s.storage) continue;
+            s.used = false;
+            return;
+        }
+        ::operator delete(pointer);
+    }
+
+    // Handlers that didn't fit a free slot and went to the heap
+    static std::atomic<uint64_t>& allocation_count() {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+private:
+    constexpr static size_t SLOT_SIZE = 1024; // Fits an async_write over a gathered buffer sequence
+    constexpr static size_t SLOT_COUNT = 4; // TCP read, TCP write, UDP read and a spare
+
+    struct slot {
+        typename std::aligned_storage<SLOT_SIZE>::type storage;
+        bool used = false;
+    };
+
+    std::array<slot, SLOT_COUNT> slots;
+};
+
+// Allocator that asio picks up through a handler's get_allocator
+template<typename T>
+class handler_allocator {
+public:
+    typedef T value_type;
+
+    explicit handler_allocator(handler_memory* memory) : memory(memory) { }
+
+    template<typename U>
+    handler_allocator(const handler_allocator<U>& other) : memory(other.memory) { }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(memory->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, size_t) {
+        memory->deallocate(pointer);
+    }
+
+    template<typename U>
+    bool operator==(const handler_allocator<U>& other) const {
+        return memory == other.memory;
+    }
+
+    template<typename U>
+    bool operator!=(const handler_allocator<U>& other) const {
+        return memory != other.memory;
+    }
+
+private:
+    handler_memory* memory;
+
+    template<typename U>
+    friend class handler_allocator;
+};
+
+// Wraps a handler so its operations allocate from memory. The handler keeps the memory alive until asio has released it
+template<typename Handler>
+class memory_handler {
+public:
+    typedef handler_allocator<void> allocator_type;
+
+    memory_handler(std::shared_ptr<handler_memory> memory, Handler handler) : memory(std::move(memory)), handler(std::move(handler)) { }
+
+    allocator_type get_allocator() const {
+        return allocator_type(memory.get());
+    }
+
+    template<typename... Args>
+    void operator()(Args&&... args) {
+        handler(std::forward<Args>(args)...);
+    }
+
+private:
+    std::shared_ptr<handler_memory> memory;
+    Handler handler;
+};
+
+template<typename Handler>
+memory_handler<typename std::decay<Handler>::type> bind_memory(const std::shared_ptr<handler_memory>& memory, Handler&& handler) {
+    return memory_handler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+}
+
+// Bounds on how many bytes a connection queues for TCP while its peer isn't reading
+struct output_limits {
+    size_t low_watermark = 0x4000; // Messages stop superseding each other once the queue drains below this
+    size_t high_watermark = 0x10000; // Messages start superseding each other once the queue grows past this
+    size_t hard_limit = 0x100000; // The connection is closed rather than queue past this
+};
+
 class connection: public std::enable_shared_from_this<connection> {
 public:
     connection(asio::io_service& io_service);
+    asio::io_service& get_service();
+    void move_to(asio::io_service& service, std::error_code& error);
     bool is_open();
     virtual void close(const std::error_code& error = std::error_code());
-    void close_udp();
+    virtual void close_udp();
     void send(const packet& packet, bool flush = true);
+    void send(const std::shared_ptr<const packet>& packet, bool flush = true);
     void send_udp(const packet& packet, bool flush = true);
+    void send_latest(const std::shared_ptr<const packet>& packet, uint32_t id = 0);
+
+    // Sends a message, checked at compile time against its layout in PACKET_TYPES
+    template<typename Message, typename... T>
+    void send(const T&... values) {
+        static_assert(std::is_same<fields<T...>, typename Message::layout>::value, "Fields don't match the message layout");
+        send_fields(Message::type, std::integral_constant<bool, fields<T...>::fixed>(), values...);
+    }
+
+    // Sends a message that replaces the last one of its type for the same id, if that one is still queued while the output is congested
+    template<typename Message, typename... T>
+    void send_latest(uint32_t id, const T&... values) {
+        static_assert(std::is_same<fields<T...>, typename Message::layout>::value, "Fields don't match the message layout");
+        static_assert(fields<T...>::fixed, "Only fixed layouts can be replaced in place");
+        send_latest_fields(Message::type, id, values...);
+    }
+
+    template<typename Message, typename... T>
+    void send_udp(const T&... values) {
+        static_assert(std::is_same<fields<T...>, typename Message::layout>::value, "Fields don't match the message layout");
+        send_udp_fields(Message::type, std::integral_constant<bool, fields<T...>::fixed>(), values...);
+    }
+
     void flush();
     void flush_udp();
     void flush_all();
+    void set_output_limits(const output_limits& limits);
+    size_t get_output_queue_depth() const;
+    bool is_congested() const;
+
+    static std::atomic<uint64_t> udp_syscall_count;
+
+    constexpr static size_t MAX_UDP_SIZE = 508;
 
 protected:
     virtual void on_receive(packet& packet, bool udp) = 0;
+    // Handles a message in place in the receive buffer. Returns false to have it copied into a packet for on_receive
+    virtual bool on_receive(packet_reader, bool) { return false; }
     virtual void on_error(const std::error_code& error) = 0;
 
-    void query_udp_port(std::function<void()> handler);
-    void receive_tcp_packet_size(std::function<void(size_t)> handler, size_t size = 0, int shift = 0);
     void receive_tcp_packet();
     void receive_udp_packet();
+    bool receive_tcp_frames();
+    bool receive_udp_batch();
+    void receive_datagram(packet& datagram);
+    void receive_message(const uint8_t* data, size_t size, packet& buffer, bool udp);
+    void on_malformed(bool udp);
+
+    // Fixed layouts are written straight into the output buffer, with a length prefix known from the types alone
+    template<typename Type, typename... T>
+    void send_fields(Type type, std::true_type, const T&... values) {
+        if (!start_message(fields<Type, T...>::min)) return;
+        tcp_output.data.write_fixed(type, values...);
+        flush();
+    }
 
+    template<typename Type, typename... T>
+    void send_fields(Type type, std::false_type, const T&... values) {
+        packet p;
+        p << type;
+        int expand[] = { 0, (p << values, 0)... };
+        (void)expand;
+        send(p);
+    }
+
+    template<typename Type, typename... T>
+    void send_udp_fields(Type type, std::true_type, const T&... values) {
+        if (!start_udp_message(fields<Type, T...>::min)) return;
+        udp_output_buffer.write_fixed(type, values...);
+        flush_udp();
+    }
+
+    template<typename Type, typename... T>
+    void send_udp_fields(Type type, std::false_type, const T&... values) {
+        packet p;
+        p << type;
+        int expand[] = { 0, (p << values, 0)... };
+        (void)expand;
+        send_udp(p);
+    }
+
+    // Resumes one of the I/O coroutines below, unless the connection or the socket it was waiting on is gone
+    struct resume {
+        void (connection::*step)(const std::error_code& error, size_t transferred);
+        connection* c;
+        std::weak_ptr<connection> self;
+        std::shared_ptr<void> socket;
+        std::shared_ptr<void> data; // Keeps buffers alive for the operation
+        std::shared_ptr<handler_memory> memory;
+
+        typedef handler_allocator<void> allocator_type;
+        allocator_type get_allocator() const { return allocator_type(memory.get()); }
+
+        void operator()(const std::error_code& error, size_t transferred = 0) const;
+    };
+
+    void read_tcp(const std::error_code& error = std::error_code(), size_t transferred = 0);
+    void write_tcp(const std::error_code& error = std::error_code(), size_t transferred = 0);
+    void read_udp(const std::error_code& error = std::error_code(), size_t transferred = 0);
+    void prepare_write();
+    void requeue_write();
+    void on_output_overflow();
+    template<typename Type, typename... T>
+    void send_latest_fields(Type type, uint32_t id, const T&... values) {
+        size_t size = fields<Type, T...>::min;
+        auto latest = find_latest(type, id, size, false);
+        if (latest) {
+            // Write the new message at the end, then move it over the old one
+            auto end = tcp_output.data.size();
+            tcp_output.data.write_fixed(type, values...);
+            std::copy(tcp_output.data.begin() + end, tcp_output.data.end(), tcp_output.data.begin() + latest->offset);
+            tcp_output.data.resize(end);
+            superseded_count++;
+            return;
+        }
+        if (!start_message(size)) return;
+        set_latest(type, id, size, SIZE_MAX);
+        tcp_output.data.write_fixed(type, values...);
+        flush();
+    }
+
+    bool start_message(size_t size);
+    bool start_udp_message(size_t size);
+    void queue_udp();
+    virtual bool is_udp_open();
+    virtual void write_udp(datagram* datagrams, size_t count);
+
+    asio::io_service* my_service;
     asio::ip::udp::resolver udp_resolver;
     std::shared_ptr<asio::ip::tcp::socket> tcp_socket;
     std::shared_ptr<asio::ip::udp::socket> udp_socket;
     asio::ip::address external_address;
-    uint16_t external_udp_port = 0;
 
-    packet tcp_output_buffer;
+    packet tcp_input_buffer;
+    size_t tcp_input_start = 0;
+    size_t tcp_input_end = 0;
+    packet tcp_input_packet;
+    struct output_buffer {
+        packet data; // Length prefixes and unshared packets
+        std::vector<std::pair<size_t, std::shared_ptr<const packet>>> shared; // Shared packets and the data offset each one follows
+        std::vector<asio::const_buffer> buffers;
+        size_t shared_size = 0; // Bytes in the shared packets
+        struct latest_message {
+            uint8_t type;
+            uint32_t id;
+            size_t offset; // Where the message starts in data, after its length prefix
+            size_t size;
+            size_t shared_index; // Its entry in shared, or SIZE_MAX if it's in data
+        };
+        std::vector<latest_message> latest; // Messages sent with send_latest that can still be replaced
+
+        size_t size() const;
+        void consume(size_t size); // Drops written bytes from the front of buffers
+        void clear();
+    };
+
+    output_buffer::latest_message* find_latest(uint8_t type, uint32_t id, size_t size, bool shared);
+    void set_latest(uint8_t type, uint32_t id, size_t size, size_t shared_index);
+
+    output_buffer tcp_output;
+    std::shared_ptr<output_buffer> tcp_writing = std::make_shared<output_buffer>();
+    packet udp_header;
     packet udp_output_buffer;
+    std::vector<datagram> udp_output_queue;
+    size_t udp_output_count = 0;
+    std::vector<datagram> udp_input_buffers;
+    packet udp_input_packet;
+    std::shared_ptr<handler_memory> io_memory = std::make_shared<handler_memory>();
+    asio::coroutine tcp_reader;
+    asio::coroutine tcp_writer;
+    asio::coroutine udp_reader;
     bool flushing = false;
+    bool tcp_write_moved = false; // move_to interrupted the write in progress
+    output_limits limits;
+    bool congested = false;
+    bool overflowed = false;
+    size_t peak_output_queue_depth = 0;
+    uint64_t superseded_count = 0;
     bool udp_established = false;
+    const message_bounds* receive_bounds = nullptr; // The size bounds of the messages this end receives
 
-    constexpr static size_t MAX_UDP_SIZE = 508;
+    constexpr static size_t TCP_BUFFER_SIZE = 0x2000;
+    constexpr static size_t UDP_BATCH_SIZE = 16;
 };
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "stdafx.h"
+
+#include "server.h"
+#include "common.h"
+#include "version.h"
+
+using namespace std;
+using namespace asio;
+
+#ifdef __GNUC__
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+void handle(int sig) {
+    log(cerr, "SIGNAL: " + to_string(sig));
+    print_stack_trace();
+    exit(1);
+}
+#endif
+#endif
+
+int main(int argc, char* argv[]) {
+#ifdef __GNUC__
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+    signal(SIGSEGV, handle);
+#endif
+#endif
+    log(APP_NAME_AND_VERSION);
+
+    try {
+        uint16_t port = argc >= 2 ? stoi(argv[1]) : 6400;
+        size_t worker_count = argc >= 3 ? stoi(argv[2]) : 0;
+
+        // A comma separated list of cores turns on low latency mode: pinned threads that spin before blocking
+        low_latency_options options;
+        if (argc >= 4) {
+            stringstream cpus(argv[3]);
+            string cpu;
+            while (getline(cpus, cpu, ',')) {
+                options.cpus.push_back(stoi(cpu));
+            }
+            options.spin_budget = 50us;
+            options.busy_poll = 50;
+            log("Low latency mode on CPUs " + string(argv[3]));
+        }
+
+        io_service service;
+        server my_server(service, true, worker_count, options);
+        my_server.open(port);
+        run_service(service, options.spin_budget);
+    } catch (const exception& e) {
+        log(cerr, e.what());
+        return 1;
+    } catch (const error_code& e) {
+        log(cerr, e.message());
+        return 1;
+    }
+
+    return 0;
+}
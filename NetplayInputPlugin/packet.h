@@ -2,17 +2,188 @@
 
 #include "stdafx.h"
 
-class packet : public std::vector<uint8_t> {
+// A byte vector that keeps up to INLINE_SIZE bytes inside the object and only allocates once it grows past that
+class byte_buffer {
+public:
+    typedef uint8_t value_type;
+    typedef uint8_t* iterator;
+    typedef const uint8_t* const_iterator;
+
+    constexpr static size_t INLINE_SIZE = 64;
+
+    byte_buffer() { }
+    explicit byte_buffer(size_t size) { resize(size); }
+    byte_buffer(const byte_buffer& other) { assign(other.begin(), other.end()); }
+    byte_buffer(byte_buffer&& other) noexcept { take(other); }
+
+    ~byte_buffer() {
+        if (ptr != local) delete[] ptr;
+    }
+
+    byte_buffer& operator=(const byte_buffer& other) {
+        if (this != &other) assign(other.begin(), other.end());
+        return *this;
+    }
+
+    byte_buffer& operator=(byte_buffer&& other) noexcept {
+        if (this != &other) {
+            if (ptr != local) delete[] ptr;
+            take(other);
+        }
+        return *this;
+    }
+
+    uint8_t* data() { return ptr; }
+    const uint8_t* data() const { return ptr; }
+    iterator begin() { return ptr; }
+    const_iterator begin() const { return ptr; }
+    iterator end() { return ptr + count; }
+    const_iterator end() const { return ptr + count; }
+    uint8_t& operator[](size_t i) { return ptr[i]; }
+    const uint8_t& operator[](size_t i) const { return ptr[i]; }
+    uint8_t& back() { return ptr[count - 1]; }
+    const uint8_t& back() const { return ptr[count - 1]; }
+    size_t size() const { return count; }
+    size_t capacity() const { return cap; }
+    bool empty() const { return count == 0; }
+
+    void clear() {
+        count = 0;
+    }
+
+    void reserve(size_t size) {
+        if (size > cap) reallocate(std::max(size, cap * 2));
+    }
+
+    void resize(size_t size) {
+        reserve(size);
+        if (size > count) memset(ptr + count, 0, size - count);
+        count = size;
+    }
+
+    void resize(size_t size, uint8_t value) {
+        reserve(size);
+        if (size > count) memset(ptr + count, value, size - count);
+        count = size;
+    }
+
+    void push_back(uint8_t value) {
+        if (count == cap) reallocate(cap * 2);
+        ptr[count++] = value;
+    }
+
+    template<typename InputIt>
+    iterator insert(const_iterator pos, InputIt first, InputIt last) {
+        size_t offset = pos - ptr;
+        size_t n = std::distance(first, last);
+        if (count + n > cap) { // Copy into the new storage before the old is released, in case the range is our own
+            size_t new_cap = std::max(count + n, cap * 2);
+            auto p = new uint8_t[new_cap];
+            memcpy(p, ptr, offset);
+            std::copy(first, last, p + offset);
+            memcpy(p + offset + n, ptr + offset, count - offset);
+            if (ptr != local) delete[] ptr;
+            ptr = p;
+            cap = new_cap;
+        } else {
+            memmove(ptr + offset + n, ptr + offset, count - offset);
+            std::copy(first, last, ptr + offset);
+        }
+        count += n;
+        return ptr + offset;
+    }
+
+    template<typename InputIt>
+    void assign(InputIt first, InputIt last) {
+        size_t n = std::distance(first, last);
+        if (n > cap) {
+            byte_buffer result;
+            result.insert(result.end(), first, last);
+            swap(result);
+        } else {
+            std::copy(first, last, ptr);
+            count = n;
+        }
+    }
+
+    // Returns to inline storage when the contents fit, or trims the allocation to size
+    void shrink_to_fit() {
+        if (ptr == local || count == cap) return;
+        reallocate(count);
+    }
+
+    void swap(byte_buffer& other) {
+        byte_buffer temp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(temp);
+    }
+
+private:
+    uint8_t* ptr = local;
+    size_t count = 0;
+    size_t cap = INLINE_SIZE;
+    uint8_t local[INLINE_SIZE];
+
+    void reallocate(size_t new_cap) {
+        auto p = new_cap <= INLINE_SIZE ? local : new uint8_t[new_cap];
+        if (p == ptr) return;
+        memmove(p, ptr, count);
+        if (ptr != local) delete[] ptr;
+        ptr = p;
+        cap = new_cap > INLINE_SIZE ? new_cap : INLINE_SIZE;
+    }
+
+    void take(byte_buffer& other) {
+        count = other.count;
+        if (other.ptr == other.local) {
+            ptr = local;
+            cap = INLINE_SIZE;
+            memcpy(local, other.local, count);
+        } else {
+            ptr = other.ptr;
+            cap = other.cap;
+        }
+        other.ptr = other.local;
+        other.count = 0;
+        other.cap = INLINE_SIZE;
+    }
+};
+
+// Encoded size of a fixed-size value, as written by packet::write
+template<typename T>
+struct encoded_size {
+    constexpr static size_t value = sizeof(typename std::make_unsigned<T>::type);
+};
+
+template<>
+struct encoded_size<bool> {
+    constexpr static size_t value = 1;
+};
+
+template<>
+struct encoded_size<float> {
+    constexpr static size_t value = 4;
+};
+
+template<>
+struct encoded_size<double> {
+    constexpr static size_t value = 8;
+};
+
+template<typename... T>
+struct fields;
+
+class packet : public byte_buffer {
 public:
     constexpr static size_t MAX_SIZE = 0xFFFF;
 
     packet() { }
-    packet(size_t size) : std::vector<uint8_t>(size) { }
+    packet(size_t size) : byte_buffer(size) { }
 
     template<typename T>
     packet& write(const T& value) {
         typedef typename std::make_unsigned<T>::type unsigned_t;
-        helper<unsigned_t>::write(*this, reinterpret_cast<const unsigned_t&>(value));
+        store(extend(sizeof(unsigned_t)), reinterpret_cast<const unsigned_t&>(value));
         return *this;
     }
 
@@ -39,61 +210,13 @@ public:
         return *this;
     }
 
-    packet& transpose(const std::vector<uint8_t>& src, size_t rows) {
-        if (rows == 0) return *this;
-
-        reserve(size() + src.size());
-
-        size_t cols = src.size() / rows;
-        for (size_t c = 0; c < cols; ++c) {
-            for (size_t i = c; i < src.size(); i += cols) {
-                write(src[i]);
-            }
-        }
-
-        return *this;
-    }
-
-    packet& write_rle(const std::vector<uint8_t>& v) {
-        std::vector<uint8_t>::const_iterator end_it;
-        for (auto raw_it = v.begin(); raw_it < v.end(); raw_it = end_it) {
-            std::vector<uint8_t>::const_iterator run_it;
-            size_t raw, run;
-            for (run_it = raw_it, raw = 0; run_it < v.end(); run_it = end_it, raw += run) {
-                for (end_it = run_it + 1, run = 1; end_it < v.end(); ++end_it, ++run) {
-                    if (*end_it != *run_it) break;
-                }
-                if (run == 1) {
-                    for (; end_it < v.end(); ++end_it, ++run) {
-                        if (*end_it != static_cast<uint8_t>(*run_it + run)) break;
-                    }
-                }
-                if (run >= 4 || run >= 2 && raw == 0) {
-                    break;
-                }
-            }
-            if (raw > 0) { // Raw Data
-                write_var((raw << 2) | 0);
-                for (auto it = raw_it; it < run_it; ++it) {
-                    write(*it);
-                }
-            }
-            if (run >= 4 || run >= 2 && raw == 0) {
-                if (*run_it == *(run_it + 1)) { // Run
-                    if (*run_it == 0) { // Zero Run
-                        write_var((run << 2) | 1);
-                    } else { // Non-Zero Run
-                        write_var((run << 2) | 2);
-                        write(*run_it);
-                    }
-                } else { // Sequence
-                    write_var((run << 2) | 3);
-                    write(*run_it);
-                }
-            }
-        }
-        write_var(0); // End
-
+    // Appends values whose encoded size is known from their types alone, after growing the packet once
+    template<typename... T>
+    packet& write_fixed(const T&... values) {
+        static_assert(fields<T...>::fixed, "write_fixed takes fixed-size values only");
+        reserve(size() + fields<T...>::min);
+        int expand[] = { 0, (write(values), 0)... };
+        (void)expand;
         return *this;
     }
 
@@ -105,10 +228,39 @@ public:
     template<typename T>
     T read() {
         typedef typename std::make_unsigned<T>::type unsigned_t;
-        auto value = helper<unsigned_t>::read(*this);
+        auto value = load<unsigned_t>(consume(sizeof(unsigned_t)));
         return reinterpret_cast<T&>(value);
     }
 
+    // Appends size bytes for the caller to fill in
+    uint8_t* extend(size_t size) {
+        auto offset = this->size();
+        resize(offset + size);
+        return data() + offset;
+    }
+
+    // Moves past size bytes, after a single bounds check, and returns them
+    const uint8_t* consume(size_t size) {
+        if (size > available()) throw std::out_of_range("read past end of packet");
+        auto result = data() + pos;
+        pos += size;
+        return result;
+    }
+
+    // Big-endian stores and loads of unsigned values into raw bytes
+    template<typename T>
+    static void store(uint8_t* dst, T value) {
+        value = byte_order<T>::swap(value);
+        memcpy(dst, &value, sizeof(T));
+    }
+
+    template<typename T>
+    static T load(const uint8_t* src) {
+        T value;
+        memcpy(&value, src, sizeof(T));
+        return byte_order<T>::swap(value);
+    }
+
     template<typename T>
     T read_var() {
         uint8_t byte, shift = 0;
@@ -126,66 +278,19 @@ public:
     packet& read(packet& packet) {
         auto size = read_var<size_t>();
         if (size > MAX_SIZE) throw std::runtime_error("packet too large");
-        packet.resize(size);
-        for (size_t i = 0; i < packet.size(); i++) {
-            packet[i] = at(pos++);
-        }
+        auto src = consume(size);
+        packet.assign(src, src + size);
         return packet;
     }
 
     std::string& read(std::string& string) {
         auto size = read_var<size_t>();
         if (size > MAX_SIZE) throw std::runtime_error("string too large");
-        string.resize(size);
-        for (size_t i = 0; i < string.length(); i++) {
-            string[i] = at(pos++);
-        }
+        auto src = consume(size);
+        string.assign(reinterpret_cast<const char*>(src), size);
         return string;
     }
 
-    packet read_rle() {
-        packet result;
-
-        while (auto value = read_var<size_t>()) {
-            auto type = value & 0b11;
-            auto size = value >>= 2;
-            if (size > MAX_SIZE) throw std::runtime_error("size too large");
-            switch (type) {
-                case 0: { // Raw Data
-                    for (size_t i = 0; i < size; i++) {
-                        result.write(read<uint8_t>());
-                    }
-                    break;
-                }
-
-                case 1: { // Zero Run
-                    for (size_t i = 0; i < size; i++) {
-                        result.write<uint8_t>(0);
-                    }
-                    break;
-                }
-
-                case 2: { // Non-Zero Run
-                    auto value = read<uint8_t>();
-                    for (size_t i = 0; i < size; i++) {
-                        result.write(value);
-                    }
-                    break;
-                }
-
-                case 3 : { // Sequence
-                    auto value = read<uint8_t>();
-                    for (size_t i = 0; i < size; i++) {
-                        result.write(value++);
-                    }
-                    break;
-                }
-            }
-        }
-
-        return result;
-    }
-
     template<typename T>
     packet& operator>>(T& value) {
         value = read<T>();
@@ -205,8 +310,17 @@ public:
         return *this;
     }
 
+    size_t position() const {
+        return pos;
+    }
+
+    packet& rewind(size_t pos = 0) {
+        this->pos = pos;
+        return *this;
+    }
+
     void swap(packet& other) {
-        std::vector<uint8_t>::swap(other);
+        byte_buffer::swap(other);
         std::swap(pos, other.pos);
     }
 
@@ -214,27 +328,33 @@ private:
     size_t pos = 0;
 
     template<typename T, size_t S = sizeof(T)>
-    struct helper {
-        inline static void write(packet& p, const T& value) {
-            static_assert(S > 1, "Invalid size parameter");
-            constexpr auto R = S / 2, L = S - R;
-            helper<T, L>::write(p, value >> (R * 8));
-            helper<T, R>::write(p, value);
-        }
-
-        inline static T read(packet& p) {
-            static_assert(S > 1, "Invalid size parameter");
-            constexpr auto R = S / 2, L = S - R;
-            auto result = helper<T, L>::read(p) << (R * 8);
-            return result | helper<T, R>::read(p);
-        }
+    struct byte_order {
+        static_assert(S == 1, "Invalid size parameter");
+        inline static T swap(T value) { return value; }
     };
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
     template<typename T>
-    struct helper<T, 1> {
-        inline static void write(packet& p, const T& value) { p.push_back(static_cast<uint8_t>(value)); }
-        inline static T read(packet& p) { return static_cast<T>(p.at(p.pos++)); }
-    };
+    struct byte_order<T, 2> { inline static T swap(T value) { return value; } };
+    template<typename T>
+    struct byte_order<T, 4> { inline static T swap(T value) { return value; } };
+    template<typename T>
+    struct byte_order<T, 8> { inline static T swap(T value) { return value; } };
+#elif defined(_MSC_VER)
+    template<typename T>
+    struct byte_order<T, 2> { inline static T swap(T value) { return static_cast<T>(_byteswap_ushort(value)); } };
+    template<typename T>
+    struct byte_order<T, 4> { inline static T swap(T value) { return static_cast<T>(_byteswap_ulong(value)); } };
+    template<typename T>
+    struct byte_order<T, 8> { inline static T swap(T value) { return static_cast<T>(_byteswap_uint64(value)); } };
+#else
+    template<typename T>
+    struct byte_order<T, 2> { inline static T swap(T value) { return static_cast<T>(__builtin_bswap16(value)); } };
+    template<typename T>
+    struct byte_order<T, 4> { inline static T swap(T value) { return static_cast<T>(__builtin_bswap32(value)); } };
+    template<typename T>
+    struct byte_order<T, 8> { inline static T swap(T value) { return static_cast<T>(__builtin_bswap64(value)); } };
+#endif
 };
 
 template<>
@@ -279,3 +399,259 @@ inline std::string packet::read<std::string>() {
     read(string);
     return string;
 }
+
+// Message fields other than fixed-size values
+template<typename T>
+struct var { }; // A value written with write_var
+
+template<typename T>
+struct repeated { }; // Values up to the end of the message
+
+template<typename T>
+struct maybe { }; // A bool, then the value if it's true
+
+struct not_sent { }; // The whole layout of a message that isn't sent in this direction
+
+// Bounds of the encoded size of a message field
+template<typename T>
+struct field_size {
+    constexpr static bool fixed = true;
+    constexpr static size_t min = encoded_size<T>::value;
+    constexpr static size_t max = encoded_size<T>::value;
+};
+
+template<>
+struct field_size<std::string> {
+    constexpr static bool fixed = false;
+    constexpr static size_t min = 1;
+    constexpr static size_t max = packet::MAX_SIZE;
+};
+
+template<typename T>
+struct field_size<var<T>> {
+    constexpr static bool fixed = false;
+    constexpr static size_t min = 1;
+    constexpr static size_t max = (sizeof(T) * 8 + 6) / 7;
+};
+
+template<typename T>
+struct field_size<repeated<T>> {
+    constexpr static bool fixed = false;
+    constexpr static size_t min = 0;
+    constexpr static size_t max = packet::MAX_SIZE;
+};
+
+// A sequence of message fields, with the bounds of their total encoded size
+template<typename... T>
+struct fields {
+    constexpr static bool fixed = true;
+    constexpr static size_t min = 0;
+    constexpr static size_t max = 0;
+};
+
+template<typename T, typename... Rest>
+struct fields<T, Rest...> {
+    constexpr static bool fixed = field_size<T>::fixed && fields<Rest...>::fixed;
+    constexpr static size_t min = field_size<T>::min + fields<Rest...>::min;
+    constexpr static size_t max = field_size<T>::max + fields<Rest...>::max < packet::MAX_SIZE ? field_size<T>::max + fields<Rest...>::max : packet::MAX_SIZE;
+};
+
+template<>
+struct fields<not_sent> { // No size is in bounds
+    constexpr static bool fixed = false;
+    constexpr static size_t min = 1;
+    constexpr static size_t max = 0;
+};
+
+// A non-owning view for parsing untrusted input without exceptions. A read past the end, or of a malformed value,
+// returns false and leaves the reader failed, so a run of reads can be checked once at the end.
+class packet_reader {
+public:
+    packet_reader(const uint8_t* data, size_t size) : it(data), last(data + size) { }
+    packet_reader(const packet& p) : it(p.data() + std::min(p.position(), p.size())), last(p.data() + p.size()) { }
+
+    explicit operator bool() const {
+        return !failed;
+    }
+
+    size_t available() const {
+        return last - it;
+    }
+
+    const uint8_t* position() const {
+        return it;
+    }
+
+    bool fail() {
+        failed = true;
+        it = last;
+        return false;
+    }
+
+    template<typename T>
+    bool read(T& value) {
+        typedef typename std::make_unsigned<T>::type unsigned_t;
+        auto src = read_bytes(sizeof(unsigned_t));
+        auto result = src ? packet::load<unsigned_t>(src) : unsigned_t();
+        value = reinterpret_cast<T&>(result);
+        return src != nullptr;
+    }
+
+    template<typename T>
+    bool read_var(T& value) {
+        value = 0;
+        for (size_t shift = 0; shift < sizeof(T) * 8; shift += 7) {
+            if (it == last) break;
+            auto byte = *it++;
+            value |= static_cast<T>(byte & 0b01111111) << shift;
+            if (!(byte & 0b10000000)) return true;
+        }
+        return fail();
+    }
+
+    // Returns the next size bytes, or nullptr
+    const uint8_t* read_bytes(size_t size) {
+        if (size > available()) {
+            fail();
+            return nullptr;
+        }
+        auto result = it;
+        it += size;
+        return result;
+    }
+
+private:
+    const uint8_t* it;
+    const uint8_t* last;
+    bool failed = false;
+};
+
+template<>
+inline bool packet_reader::read<double>(double& value) {
+    static_assert(sizeof(uint64_t) == sizeof(double), "sizeof(double) != sizeof(uint64_t)");
+    uint64_t bits;
+    auto result = read(bits);
+    memcpy(&value, &bits, sizeof(value));
+    return result;
+}
+
+// Hands out shared packets that return to a per-thread free list, sorted by capacity, when the last reference is
+// dropped. Packets keep the storage they grew, so a steady stream of similar messages stops allocating.
+class packet_pool {
+public:
+    static std::shared_ptr<packet> make(size_t capacity = 0) {
+        auto lists = local();
+        if (lists) {
+            for (auto c = size_class(capacity); c < CLASS_COUNT; c++) {
+                auto& free = lists->packets[c];
+                if (free.empty()) continue;
+                auto p = free.back();
+                free.pop_back();
+                hit_count()++;
+                return std::shared_ptr<packet>(p, recycler(), block_allocator<packet>());
+            }
+        }
+        miss_count()++;
+        auto p = new packet();
+        p->reserve(capacity);
+        return std::shared_ptr<packet>(p, recycler(), block_allocator<packet>());
+    }
+
+    static std::atomic<uint64_t>& hit_count() {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+    static std::atomic<uint64_t>& miss_count() {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+private:
+    constexpr static size_t CLASS_COUNT = 4; // Up to 64, 512 and 4096 bytes of capacity, then anything larger
+    constexpr static size_t MAX_FREE = 256; // Per class and thread
+
+    struct free_lists {
+        std::vector<packet*> packets[CLASS_COUNT];
+        std::vector<void*> blocks; // shared_ptr control blocks, which all have the same size
+        size_t block_size = 0;
+
+        free_lists() {
+            state() = 1;
+        }
+
+        ~free_lists() {
+            state() = 2;
+            for (auto& free : packets) {
+                for (auto p : free) delete p;
+            }
+            for (auto b : blocks) ::operator delete(b);
+        }
+    };
+
+    struct recycler {
+        void operator()(packet* p) const {
+            auto lists = local();
+            if (!lists || lists->packets[size_class(p->capacity())].size() >= MAX_FREE) {
+                delete p;
+                return;
+            }
+            p->clear();
+            p->rewind();
+            lists->packets[size_class(p->capacity())].push_back(p);
+        }
+    };
+
+    template<typename T>
+    struct block_allocator {
+        typedef T value_type;
+
+        block_allocator() { }
+        template<typename U>
+        block_allocator(const block_allocator<U>&) { }
+
+        T* allocate(size_t n) {
+            auto lists = local();
+            if (lists && n == 1 && sizeof(T) == lists->block_size && !lists->blocks.empty()) {
+                auto b = lists->blocks.back();
+                lists->blocks.pop_back();
+                return static_cast<T*>(b);
+            }
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* b, size_t n) {
+            auto lists = local();
+            if (lists && n == 1 && lists->blocks.size() < MAX_FREE) {
+                if (lists->block_size == 0) lists->block_size = sizeof(T);
+                if (lists->block_size == sizeof(T)) {
+                    lists->blocks.push_back(b);
+                    return;
+                }
+            }
+            ::operator delete(b);
+        }
+
+        template<typename U>
+        bool operator==(const block_allocator<U>&) const { return true; }
+        template<typename U>
+        bool operator!=(const block_allocator<U>&) const { return false; }
+    };
+
+    static size_t size_class(size_t capacity) {
+        return capacity <= byte_buffer::INLINE_SIZE ? 0 : capacity <= 512 ? 1 : capacity <= 4096 ? 2 : 3;
+    }
+
+    // 0 before this thread's free lists are built, 1 while they exist and 2 once they've been destroyed
+    static int& state() {
+        thread_local int state = 0;
+        return state;
+    }
+
+    // This thread's free lists, or nullptr during thread exit
+    static free_lists* local() {
+        if (state() == 2) return nullptr;
+        thread_local free_lists lists;
+        return &lists;
+    }
+};
@@ -0,0 +1,494 @@
+#include "stdafx.h"
+
+#include "server.h"
+#include "common.h"
+#include "connection.h"
+
+using namespace std;
+using namespace asio;
+
+// Runs rooms of two clients that play in lockstep with no lag through an in-process server, and checks that relaying
+// their inputs doesn't allocate handlers once the rooms have settled
+class bench_client : public connection {
+public:
+    bench_client(io_service& service, const string& name, latency_histogram& frame_times) :
+        connection(service), frame_times(&frame_times) {
+        me.name = name;
+        me.map = input_map(input_map::IDENTITY_MAP);
+    }
+
+    void join(uint16_t port, const string& room) {
+        tcp_socket->connect(ip::tcp::endpoint(ip::address_v4::loopback(), port));
+        tcp_socket->set_option(ip::tcp::no_delay(true));
+        udp_socket->open(ip::udp::v4());
+        udp_socket->bind(ip::udp::endpoint(ip::address_v4::loopback(), 0));
+        send<to_server<JOIN>>(PROTOCOL_VERSION, room, me);
+        receive_tcp_packet();
+    }
+
+    bool is_running() const { return running; }
+    bool has_failed() const { return failed; }
+    uint64_t get_frame_count() const { return me.input_id; }
+
+protected:
+    void on_receive(packet& p, bool) override {
+        switch (p.read<packet_type>()) {
+            case ACCEPT: {
+                auto udp_port = p.read<uint16_t>();
+                auto udp_token = p.read<uint32_t>();
+                while (p.available()) {
+                    if (!p.read<bool>()) continue;
+                    auto info = p.read<user_info>();
+                    (info.name == me.name ? me : peer).id = info.id;
+                }
+                udp_socket->connect(ip::udp::endpoint(ip::address_v4::loopback(), udp_port));
+                udp_header.reset() << USER_DATA << udp_token;
+                receive_udp_packet();
+                send_udp<to_server<PING>>(timestamp()); // Binds our endpoint
+                break;
+            }
+
+            case JOIN: {
+                user_info info;
+                read_message<to_client<JOIN>>(p, info);
+                peer.id = info.id;
+                send<to_server<START>>(); // The first client starts the room once the second joins
+                break;
+            }
+
+            case START: {
+                started = true;
+                start_input();
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    bool on_receive(packet_reader r, bool udp) override {
+        packet_type type;
+        r.read(type);
+        switch (type) {
+            case PING: {
+                packet pong;
+                pong << PONG;
+                pong.insert(pong.end(), r.position(), r.position() + r.available());
+                if (udp) {
+                    send_udp(pong);
+                    udp_established = true;
+                    start_input();
+                } else {
+                    send(pong);
+                }
+                return true;
+            }
+
+            case INPUT_DATA: {
+                uint32_t user_id, start_id;
+                r.read_var(user_id);
+                r.read_var(start_id);
+                if (!r || user_id != peer.id) return true;
+                peer.add_input_window(r, start_id, [](const input_data&) { });
+                if (!r) {
+                    close();
+                } else if (running) {
+                    send_input();
+                }
+                return true;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    void on_error(const error_code&) override {
+        failed = running || !started;
+    }
+
+private:
+    void start_input() {
+        if (running || !started || !udp_established) return;
+        running = true;
+        send_input();
+    }
+
+    // Sends our next frame once our peer has sent theirs for the frame before, as client::send_input does
+    void send_input() {
+        if (me.input_id <= peer.input_id) {
+            auto now = std::chrono::steady_clock::now();
+            if (me.input_id > 0) {
+                frame_times->add(now - last_input_time);
+            }
+            last_input_time = now;
+        }
+        while (me.input_id <= peer.input_id) {
+            input_data input = { me.input_id, 0, 0, 0, me.map };
+            me.add_input_history(me.input_id, input);
+
+            packet p;
+            p << INPUT_DATA;
+            p.write_var(me.id);
+            p.write_var(me.input_id - me.input_history.size());
+            write_input_window(p, me.input_history);
+            send_udp(p, false);
+
+            p.reset() << INPUT_DATA;
+            p.write_var(me.id);
+            p.write_var(me.input_id - 1);
+            write_input_window(p, me.input_history, me.input_history.size() - 1);
+            send(p, false);
+        }
+        flush_all();
+    }
+
+    user_info me;
+    user_info peer;
+    latency_histogram* frame_times;
+    std::chrono::steady_clock::time_point last_input_time;
+    bool started = false;
+    bool udp_established = false;
+    bool running = false;
+    bool failed = false;
+};
+
+// How packet serialized values before it stored them with memcpy: one push_back per byte on write, and one bounds
+// checked at() per byte on read. bench_serialization times it alongside packet, so the two can be compared.
+class baseline_packet : public std::vector<uint8_t> {
+public:
+    template<typename T>
+    baseline_packet& write(const T& value) {
+        typedef typename std::make_unsigned<T>::type unsigned_t;
+        helper<unsigned_t>::write(*this, reinterpret_cast<const unsigned_t&>(value));
+        return *this;
+    }
+
+    baseline_packet& write(const std::string& string) {
+        write_var(string.length());
+        insert(end(), string.begin(), string.end());
+        return *this;
+    }
+
+    void write_var(size_t value) {
+        for (; value > 0b01111111; value >>= 7) {
+            push_back(static_cast<uint8_t>(value | 0b10000000));
+        }
+        push_back(static_cast<uint8_t>(value));
+    }
+
+    template<typename T>
+    T read() {
+        typedef typename std::make_unsigned<T>::type unsigned_t;
+        auto value = helper<unsigned_t>::read(*this);
+        return reinterpret_cast<T&>(value);
+    }
+
+    std::string read_string() {
+        size_t size = 0;
+        uint8_t byte, shift = 0;
+        do {
+            byte = read<uint8_t>();
+            size |= static_cast<size_t>(byte & 0b01111111) << shift;
+            shift += 7;
+        } while (byte & 0b10000000);
+        std::string string(size, '\0');
+        for (size_t i = 0; i < string.length(); i++) {
+            string[i] = at(pos++);
+        }
+        return string;
+    }
+
+    baseline_packet& reset() {
+        clear();
+        pos = 0;
+        return *this;
+    }
+
+private:
+    template<typename T, size_t S = sizeof(T)>
+    struct helper {
+        static void write(baseline_packet& p, const T& value) {
+            constexpr auto R = S / 2, L = S - R;
+            helper<T, L>::write(p, value >> (R * 8));
+            helper<T, R>::write(p, value);
+        }
+
+        static T read(baseline_packet& p) {
+            constexpr auto R = S / 2, L = S - R;
+            auto result = helper<T, L>::read(p) << (R * 8);
+            return result | helper<T, R>::read(p);
+        }
+    };
+
+    template<typename T>
+    struct helper<T, 1> {
+        static void write(baseline_packet& p, const T& value) { p.push_back(static_cast<uint8_t>(value)); }
+        static T read(baseline_packet& p) { return static_cast<T>(p.at(p.pos++)); }
+    };
+
+    size_t pos = 0;
+};
+
+static void write_baseline(baseline_packet& p, const input_data& input) {
+    for (auto d : input.data) p.write(d);
+    p.write(input.map.bits);
+}
+
+static input_data read_baseline_input(baseline_packet& p) {
+    input_data input;
+    for (auto& d : input.data) d = p.read<uint32_t>();
+    input.map = input_map(p.read<uint16_t>());
+    return input;
+}
+
+static void write_baseline(baseline_packet& p, const user_info& info) {
+    p.write(info.id).write(info.authority).write(info.name);
+    p.write(info.rom.crc1).write(info.rom.crc2).write(info.rom.name).write(info.rom.country_code).write(info.rom.version);
+    p.write(info.lag).write(reinterpret_cast<const uint64_t&>(info.latency));
+    for (auto& c : info.controllers) p.write(c.present).write(c.raw_data).write(c.plugin);
+    p.write(info.map.bits).write(static_cast<uint8_t>(info.manual_map));
+}
+
+static user_info read_baseline_user(baseline_packet& p) {
+    user_info info;
+    info.id = p.read<uint32_t>();
+    info.authority = p.read<uint32_t>();
+    info.name = p.read_string();
+    info.rom.crc1 = p.read<uint32_t>();
+    info.rom.crc2 = p.read<uint32_t>();
+    info.rom.name = p.read_string();
+    info.rom.country_code = p.read<char>();
+    info.rom.version = p.read<uint8_t>();
+    info.lag = p.read<uint8_t>();
+    auto latency = p.read<uint64_t>();
+    info.latency = reinterpret_cast<double&>(latency);
+    for (auto& c : info.controllers) {
+        c.present = p.read<int>();
+        c.raw_data = p.read<int>();
+        c.plugin = p.read<int>();
+    }
+    info.map = input_map(p.read<uint16_t>());
+    info.manual_map = p.read<uint8_t>() != 0;
+    return info;
+}
+
+// Times writing the fields of a message into a packet and reading them back, in nanoseconds per message
+template<typename P = packet, typename F>
+static double time_round_trip(F round_trip) {
+    constexpr size_t COUNT = 1000000;
+    P p;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < COUNT; i++) {
+        round_trip(p.reset());
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / COUNT;
+}
+
+// Checks windows assembled from the history's cached deltas against encoding every frame afresh, and that they decode
+// back to the masked frames
+static bool check_input_codec() {
+    mt19937 rng(1);
+    input_history_buffer history;
+    auto input = input_data();
+    for (size_t n = 0; n < 1000; n++) {
+        // Mostly a bit or two at a time, with the occasional new axis value or map
+        auto r = rng();
+        input.data[r % 4] ^= 1u << (r >> 8) % 32;
+        if (r % 5 == 0) input.data[(r >> 16) % 4] = rng();
+        if (r % 16 == 0) input.map = input_map(static_cast<uint16_t>(rng()));
+        history.push_back(input);
+
+        for (size_t first = 0; first <= history.size(); first++) {
+            packet window;
+            write_input_window(window, history, first);
+
+            packet expected;
+            expected.write_var(history.size() - first);
+            bit_writer w(expected);
+            auto previous = input_data();
+            for (size_t i = first; i < history.size(); i++) {
+                previous = write_input_delta(w, history[i], previous);
+            }
+            w.flush();
+            if (window.size() != expected.size() || memcmp(window.data(), expected.data(), window.size())) return false;
+
+            packet_reader reader(window);
+            auto i = first;
+            bool decoded = true;
+            read_input_window(reader, [&](const input_data& frame) {
+                decoded = decoded && i < history.size() && mask_unmapped(history[i++]) == frame;
+            });
+            if (!reader || reader.available() || i != history.size() || !decoded) return false;
+        }
+    }
+    return true;
+}
+
+static void bench_serialization() {
+    input_data input = { 0x12345678, 0x9ABCDEF0, 0, 0, input_map(input_map::IDENTITY_MAP) };
+    user_info info;
+    info.name = "alice";
+    volatile uint32_t sink = 0;
+
+    auto input_update = time_round_trip([&](packet& p) {
+        p << INPUT_UPDATE << info.id << input;
+        p.read<packet_type>();
+        sink = p.read<uint32_t>() + p.read<input_data>().data[0];
+    });
+    auto join = time_round_trip([&](packet& p) {
+        p << JOIN << info;
+        p.read<packet_type>();
+        sink = p.read<user_info>().id;
+    });
+
+    auto baseline_input_update = time_round_trip<baseline_packet>([&](baseline_packet& p) {
+        p.write(static_cast<uint8_t>(INPUT_UPDATE)).write(info.id);
+        write_baseline(p, input);
+        p.read<uint8_t>();
+        sink = p.read<uint32_t>() + read_baseline_input(p).data[0];
+    });
+    auto baseline_join = time_round_trip<baseline_packet>([&](baseline_packet& p) {
+        p.write(static_cast<uint8_t>(JOIN));
+        write_baseline(p, info);
+        p.read<uint8_t>();
+        sink = read_baseline_user(p).id;
+    });
+
+    input_history_buffer history;
+    for (uint32_t i = 0; i < history.capacity(); i++) {
+        input.data[0] ^= 1u << i % 16;
+        history.push_back(input);
+    }
+    auto input_window = time_round_trip([&](packet& p) {
+        write_input_window(p, history);
+        packet_reader r(p);
+        read_input_window(r, [&](const input_data& frame) { sink = frame.data[0]; });
+    });
+
+    stringstream ss;
+    ss << fixed << setprecision(1) << "Serialization round trips: INPUT_UPDATE " << input_update << " ns (byte at a time "
+        << baseline_input_update << " ns), JOIN " << join << " ns (byte at a time " << baseline_join << " ns), "
+        << history.size() << " frame input window " << input_window << " ns";
+    log(ss.str());
+}
+
+constexpr uint64_t WARMUP_FRAMES = 1000; // Frames every client sends before the measured run starts
+
+int main(int argc, char* argv[]) {
+    size_t room_count = argc >= 2 ? stoi(argv[1]) : 4;
+    size_t worker_count = argc >= 3 ? stoi(argv[2]) : 0;
+    auto duration = std::chrono::seconds(argc >= 4 ? stoi(argv[3]) : 5);
+
+    try {
+        // A comma separated list of cores runs the server in low latency mode, as it does for netplay_server
+        low_latency_options options;
+        if (argc >= 5) {
+            stringstream cpus(argv[4]);
+            string cpu;
+            while (getline(cpus, cpu, ',')) {
+                options.cpus.push_back(stoi(cpu));
+            }
+            options.spin_budget = 50us;
+            options.busy_poll = 50;
+        }
+
+        if (!check_input_codec()) {
+            log(cerr, "Input windows don't match their frames");
+            return 1;
+        }
+        bench_serialization();
+
+        io_service server_service;
+        server my_server(server_service, true, worker_count, options);
+        auto port = my_server.open(0);
+        thread server_thread([&] { run_service(server_service, options.spin_budget); });
+
+        io_service client_service;
+        latency_histogram frame_times; // From sending a frame to sending the next, which waits on the peer's frame
+        vector<shared_ptr<bench_client>> clients;
+        for (size_t i = 0; i < room_count; i++) {
+            for (auto name : { "alice", "bob" }) {
+                clients.push_back(make_shared<bench_client>(client_service, name, frame_times));
+                clients.back()->join(port, "bench" + to_string(i));
+            }
+        }
+
+        auto frame_count = [&] {
+            uint64_t result = 0;
+            for (auto& c : clients) {
+                result += c->get_frame_count();
+            }
+            return result;
+        };
+
+        // Wait for every room to warm up, then count frames and handler allocations over the measured run
+        bool measuring = false;
+        bool timed_out = false;
+        auto setup_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        std::chrono::steady_clock::time_point start_time, end_time;
+        uint64_t start_frames = 0, end_frames = 0, start_allocations = 0, end_allocations = 0;
+        array<uint64_t, latency_histogram::BUCKET_COUNT> frame_time_counts;
+        steady_timer timer(client_service);
+        function<void()> on_tick = [&] {
+            for (auto& c : clients) {
+                if (c->has_failed()) return client_service.stop();
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (!measuring) {
+                bool warm = all_of(clients.begin(), clients.end(), [](auto& c) {
+                    return c->is_running() && c->get_frame_count() >= WARMUP_FRAMES;
+                });
+                if (warm) {
+                    measuring = true;
+                    start_time = now;
+                    start_frames = frame_count();
+                    start_allocations = handler_memory::allocation_count();
+                    frame_times.take();
+                } else if (now > setup_deadline) {
+                    timed_out = true;
+                    return client_service.stop();
+                }
+            } else if (now - start_time >= duration) {
+                end_time = now;
+                end_frames = frame_count();
+                end_allocations = handler_memory::allocation_count();
+                frame_time_counts = frame_times.take();
+                return client_service.stop();
+            }
+            timer.expires_after(std::chrono::milliseconds(100));
+            timer.async_wait([&](const error_code& error) { if (!error) on_tick(); });
+        };
+        on_tick();
+        client_service.run();
+
+        server_service.stop();
+        server_thread.join();
+
+        if (any_of(clients.begin(), clients.end(), [](auto& c) { return c->has_failed(); })) {
+            log(cerr, "A client was disconnected");
+            return 1;
+        }
+        if (timed_out) {
+            log(cerr, "Rooms didn't warm up");
+            return 1;
+        }
+
+        auto seconds = std::chrono::duration<double>(end_time - start_time).count();
+        auto frames = end_frames - start_frames;
+        auto allocations = end_allocations - start_allocations;
+        stringstream ss;
+        ss << fixed << setprecision(0) << frames / seconds;
+        log(to_string(room_count) + " rooms, " + to_string(worker_count) + " workers: " + ss.str() + " inputs/s relayed");
+        log("Lockstep frame times: " + latency_histogram::to_string(frame_time_counts));
+        log("Handler allocations in steady state: " + to_string(allocations));
+        return allocations == 0 ? 0 : 1;
+    } catch (const exception& e) {
+        log(cerr, e.what());
+        return 1;
+    } catch (const error_code& e) {
+        log(cerr, e.message());
+        return 1;
+    }
+}
@@ -58,7 +58,7 @@ void room::on_user_join(user* user) {
         golf = true;
     }
 
-    user->send(packet() << GOLF << golf);
+    user->send<to_client<GOLF>>(golf);
 }
 
 void room::on_user_quit(user* user) {
@@ -80,6 +80,7 @@ void room::on_user_quit(user* user) {
 
     for (auto& u : user_list) {
         u->udp_output_buffer.clear();
+        u->udp_output_count = 0;
         u->send_quit(user->id);
     }
 
@@ -145,7 +146,7 @@ void room::on_game_start() {
         u->send_start_game();
     }
 
-    my_server->log_room_list();
+    my_server->on_room_start(this);
 }
 
 void room::update_controller_map() {
@@ -162,13 +163,13 @@ void room::update_controller_map() {
 }
 
 void room::send_controllers() {
-    packet p;
-    p << CONTROLLERS;
+    auto p(packet_pool::make());
+    *p << CONTROLLERS;
     for (auto& u : user_list) {
         for (auto& c : u->controllers) {
-            p << c;
+            *p << c;
         }
-        p << u->map;
+        *p << u->map;
     }
 
     for (auto& u : user_list) {
@@ -191,15 +192,15 @@ void room::send_error(const string& message) {
 }
 
 void room::set_lag(uint8_t lag, user* source) {
-    packet p;
-    p << LAG << lag << (source ? source->id : 0xFFFFFFFF);
+    auto p(packet_pool::make());
+    *p << LAG << lag << (source ? source->id : 0xFFFFFFFF);
 
     this->lag = lag;
 
     for (auto& u : user_list) {
         if (u == source) continue;
         u->lag = lag;
-        p << u->id;
+        *p << u->id;
     }
 
     for (auto& u : user_list) {
@@ -215,12 +216,12 @@ void room::set_lag(uint8_t lag, user* source) {
 }
 
 void room::send_latencies() {
-    packet p;
-    p << LATENCY;
+    auto p(packet_pool::make());
+    *p << LATENCY;
     for (auto& u : user_list) {
-        p << u->latency;
+        *p << u->latency;
     }
     for (auto& u : user_list) {
-        u->send(p);
+        u->send_latest(p);
     }
 }
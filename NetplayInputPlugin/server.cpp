@@ -3,19 +3,54 @@
 #include "server.h"
 #include "room.h"
 #include "user.h"
-#include "version.h"
 
 using namespace std;
 using namespace asio;
 
-server::server(io_service& service, bool multiroom) :
-     service(&service), multiroom(multiroom), acceptor(service), udp_socket(service), timer(service) {
+#if defined(_WIN32) && !defined(SIO_UDP_CONNRESET)
+#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12) // From mstcpip.h
+#endif
+
+#ifdef __linux__
+static void pin_this_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result) {
+        log(cerr, "Failed to pin thread to CPU " + to_string(cpu) + ": " + error_code(result, asio::error::get_system_category()).message());
+    }
+}
+#endif
+
+server::server(io_service& service, bool multiroom, size_t worker_count, const low_latency_options& options) :
+     service(&service), multiroom(multiroom), options(options), acceptor(service), router(service, this), timer(service) {
 #ifdef _WIN32
     QOS_VERSION version;
     version.MajorVersion = 1;
     version.MinorVersion = 0;
     QOSCreateHandle(&version, &qos_handle);
 #endif
+
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.push_back(make_unique<worker>(this, options.spin_budget));
+    }
+
+#ifdef __linux__
+    // Pin from inside each loop, since the thread that runs the main loop needn't be the one constructing us
+    if (!options.cpus.empty()) {
+        service.post([cpu = options.cpus[0]] { pin_this_thread(cpu); });
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i]->loop.service.post([cpu = options.cpus[(i + 1) % options.cpus.size()]] { pin_this_thread(cpu); });
+        }
+    }
+#endif
+}
+
+server::~server() {
+    for (auto& w : workers) {
+        w->loop.stop();
+    }
 }
 
 uint16_t server::open(uint16_t port) {
@@ -34,11 +69,12 @@ uint16_t server::open(uint16_t port) {
     acceptor.bind(ip::tcp::endpoint(ipv_tcp, port));
     acceptor.listen();
 
-    udp_socket.open(ipv_udp);
-    udp_socket.bind(ip::udp::endpoint(ipv_udp, acceptor.local_endpoint().port()));
+    router.open(ip::udp::endpoint(ipv_udp, acceptor.local_endpoint().port()));
+    for (auto& w : workers) {
+        w->loop.run([&] { return w->router.open(ip::udp::endpoint(ipv_udp, 0)); });
+    }
 
     accept();
-    read();
 
     on_tick();
 
@@ -53,8 +89,9 @@ void server::close() {
         acceptor.close(error);
     }
 
-    if (udp_socket.is_open()) {
-        udp_socket.close();
+    router.close();
+    for (auto& w : workers) {
+        w->loop.service.dispatch([r = &w->router] { r->close(); });
     }
 
     timer.cancel();
@@ -62,19 +99,20 @@ void server::close() {
     auto r = rooms;
     rooms.clear();
     for (auto& e : r) {
-        e.second->close();
+        get_room_router(e.first).get_service().dispatch([room = e.second] { room->close(); });
     }
 }
 
 void server::accept() {
     auto u = make_shared<user>(this);
-    acceptor.async_accept(*(u->tcp_socket), [=](error_code error) {
+    acceptor.async_accept(*(u->tcp_socket), bind_memory(io_memory, [=](error_code error) {
         if (error) return log(cerr, error.message());
 
         auto ep = u->tcp_socket->remote_endpoint(error);
         if (error) return accept();
 
         u->address = endpoint_to_string(ep, true);
+        u->tcp_address = ep.address();
 
         u->tcp_socket->set_option(ip::tcp::no_delay(true), error);
         if (error) return accept();
@@ -92,56 +130,32 @@ void server::accept() {
         }
         if (error) return accept();
 #endif
+        set_busy_poll(*u->tcp_socket);
 
         users[u.get()] = u;
         u->send_protocol_version();
         u->receive_tcp_packet();
 
         accept();
-    });
+    }));
 }
 
-void server::read() {
-    udp_socket.async_wait(ip::udp::socket::wait_read, [=](const error_code& error) {
-        if (error) return;
-        while (udp_socket.available()) {
-            packet p(udp_socket.available());
-            ip::udp::endpoint udp_remote_endpoint;
-            p.resize(udp_socket.receive_from(buffer(p), udp_remote_endpoint));
-            if (p.empty()) continue;
-            switch (p.read<query_type>()) {
-                case SERVER_PING: {
-                    packet pong;
-                    pong << SERVER_PONG << PROTOCOL_VERSION;
-                    while (p.available()) {
-                        pong << p.read<uint8_t>();
-                    }
-                    error_code error;
-                    udp_socket.send_to(buffer(pong), udp_remote_endpoint, 0, error);
-                    if (error) return;
-                    break;
-                }
+void server::set_busy_poll(ip::tcp::socket& socket) {
+#ifdef SO_BUSY_POLL
+    if (options.busy_poll <= 0) return;
+    error_code error;
+    socket.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(options.busy_poll), error);
+    if (error) log(cerr, "Failed to enable busy polling: " + error.message());
+#endif
+}
 
-                case EXTERNAL_ADDRESS: {
-                    packet p;
-                    p << EXTERNAL_ADDRESS << udp_remote_endpoint.port();
-                    auto addr = udp_remote_endpoint.address();
-                    if (addr.is_v4()) {
-                        for (auto b : addr.to_v4().to_bytes()) p << b;
-                    } else if (addr.is_v6() && addr.to_v6().is_v4_mapped()) {
-                        for (auto b : addr.to_v6().to_v4().to_bytes()) p << b;
-                    } else {
-                        for (auto b : addr.to_v6().to_bytes()) p << b;
-                    }
-                    error_code error;
-                    udp_socket.send_to(buffer(p), udp_remote_endpoint, 0, error);
-                    if (error) return;
-                    break;
-                }
-            }
-        }
-        read();
-    });
+void server::set_busy_poll(ip::udp::socket& socket) {
+#ifdef SO_BUSY_POLL
+    if (options.busy_poll <= 0) return;
+    error_code error;
+    socket.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(options.busy_poll), error);
+    if (error) log(cerr, "Failed to enable busy polling: " + error.message());
+#endif
 }
 
 void server::on_user_join(user* user, string room_id) {
@@ -158,36 +172,116 @@ void server::on_user_join(user* user, string room_id) {
         log_room_list();
     }
 
-    rooms[room_id]->on_user_join(user);
+    auto r = rooms[room_id];
+    auto& room_router = get_room_router(room_id);
+    auto& room_service = room_router.get_service();
+    if (&room_service == &user->get_service()) {
+        user->my_router = &room_router;
+        return r->on_user_join(user);
+    }
+
+    // Move the user's sockets to the event loop that owns the room
+    if (!user->is_open()) return;
+    auto u = users.at(user);
+    error_code error;
+    u->move_to(room_service, error);
+    if (error) {
+        log(cerr, "[" + room_id + "] Failed to move " + u->name + " to room worker: " + error.message());
+        return u->close(error);
+    }
+
+    // Handlers cancelled by the move still run on this thread, so hand the user over once they're done
+    moving_users.insert(user);
+    service->post([this, u, r, &room_router] {
+        moving_users.erase(u.get());
+        room_router.get_service().post([u, r, &room_router] {
+            u->my_router = &room_router;
+            r->on_user_join(u.get());
+            u->receive_tcp_packet();
+            u->flush();
+        });
+    });
 }
 
 void server::on_user_quit(user* user) {
-    users.erase(user);
+    service->dispatch([=] {
+        auto it = users.find(user);
+        if (it == users.end()) return;
+        auto u = move(it->second);
+        users.erase(it);
+
+        // Release the last reference on the user's own event loop
+        auto& user_service = u->get_service();
+        user_service.dispatch([u = move(u)] { });
+    });
+}
+
+void server::on_room_start(room* room) {
+    // The room may be gone by the time this runs, so only its address is compared there
+    service->dispatch([=, id = room->get_id()] {
+        auto it = rooms.find(id);
+        if (it == rooms.end() || it->second.get() != room) return;
+        started_rooms.insert(room);
+        log_room_list();
+    });
 }
 
 void server::on_room_close(room* room) {
-    auto id = room->get_id();
-    auto age = static_cast<int>(timestamp() - room->creation_timestamp);
-    if (rooms.erase(id)) {
+    // The room may be gone by the time this runs, so only its address is compared there
+    service->dispatch([=, id = room->get_id(), creation_timestamp = room->creation_timestamp] {
+        auto age = static_cast<int>(timestamp() - creation_timestamp);
+        auto it = rooms.find(id);
+        if (it == rooms.end() || it->second.get() != room) return;
+        started_rooms.erase(room);
+        rooms.erase(it);
         log("[" + id + "] Room destroyed after " + to_string(age / 60) + "m" + to_string(age % 60) + "s");
         log_room_list();
-    }
+    });
 }
 
 void server::on_tick() {
     for (auto& e : rooms) {
-        e.second->on_ping_tick();
+        get_room_router(e.first).get_service().dispatch([room = e.second] { room->on_ping_tick(); });
     }
 
     if (tick_count % 60 == 0) {
-        for (auto& u : users) {
-            u.second->send_keepalive();
+        for (auto& e : users) {
+            if (moving_users.count(e.first)) continue; // Still touched by this thread, whatever its service says
+            e.second->get_service().dispatch([u = e.second] {
+                u->send_keepalive();
+                u->log_output_queue();
+            });
+        }
+
+        uint64_t input_count = relayed_input_count;
+        uint64_t syscall_count = connection::udp_syscall_count;
+        uint64_t hit_count = packet_pool::hit_count();
+        uint64_t miss_count = packet_pool::miss_count();
+        uint64_t allocation_count = handler_memory::allocation_count();
+        if (input_count > last_relayed_input_count) {
+            auto inputs = input_count - last_relayed_input_count;
+            auto syscalls = syscall_count - last_udp_syscall_count;
+            stringstream ss;
+            ss << fixed << setprecision(2) << static_cast<double>(syscalls) / inputs;
+            log("UDP system calls per relayed input: " + ss.str() + " (" + to_string(syscalls) + "/" + to_string(inputs) + ")");
+            log("Packet pool hits/misses: " + to_string(hit_count - last_pool_hit_count) + "/" + to_string(miss_count - last_pool_miss_count));
+            log("Handler allocations: " + to_string(allocation_count - last_handler_allocation_count));
+        }
+        last_relayed_input_count = input_count;
+        last_udp_syscall_count = syscall_count;
+        last_pool_hit_count = hit_count;
+        last_pool_miss_count = miss_count;
+        last_handler_allocation_count = allocation_count;
+
+        auto latency = dispatch_latency.take();
+        if (accumulate(latency.begin(), latency.end(), uint64_t(0))) {
+            log("UDP receive to dispatch latency: " + latency_histogram::to_string(latency));
         }
     }
 
     tick_count++;
     timer.expires_after(500ms);
-    timer.async_wait([=](const error_code& error) { if (!error) on_tick(); });
+    timer.async_wait(bind_memory(io_memory, [=](const error_code& error) { if (!error) on_tick(); }));
 }
 
 string server::get_random_room_id() {
@@ -206,6 +300,14 @@ string server::get_random_room_id() {
     return result;
 }
 
+udp_router& server::get_room_router(const string& room_id) {
+    if (workers.empty()) return router;
+
+    auto key = room_id;
+    transform(key.begin(), key.end(), key.begin(), [](char c) { return tolower<char>(c, locale::classic()); });
+    return workers[hash<string>()(key) % workers.size()]->router;
+}
+
 void server::log_room_list() {
     string room_list;
     if (rooms.empty()) {
@@ -217,7 +319,7 @@ void server::log_room_list() {
             } else {
                 room_list += ", " + e.first;
             }
-            if (!e.second->started) {
+            if (started_rooms.find(e.second.get()) == started_rooms.end()) {
                 room_list += "*";
             }
         }
@@ -225,37 +327,253 @@ void server::log_room_list() {
     }
 }
 
-#ifdef __GNUC__
-#if !defined(__MINGW32__) && !defined(__MINGW64__)
-void handle(int sig) {
-    log(cerr, "SIGNAL: " + to_string(sig));
-    print_stack_trace();
-    exit(1);
+udp_router::udp_router(io_service& service, server* server) :
+    service(&service), my_server(server), socket(service), token_generator(random_device()()) { }
+
+io_service& udp_router::get_service() {
+    return *service;
 }
+
+uint16_t udp_router::get_port() const {
+    return port;
+}
+
+uint16_t udp_router::open(const ip::udp::endpoint& endpoint) {
+    socket.open(endpoint.protocol());
+    socket.bind(endpoint);
+
+#ifndef _WIN32
+    error_code error;
+    if (endpoint.address().is_v6()) {
+        socket.set_option(asio::detail::socket_option::integer<IPPROTO_IPV6, IPV6_TCLASS>(40 << 2), error);
+    }
+    socket.set_option(asio::detail::socket_option::integer<IPPROTO_IP, IP_TOS>(40 << 2), error);
+#ifdef SO_TIMESTAMPNS
+    socket.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_TIMESTAMPNS>(true), error);
 #endif
+#else
+    // Every room shares this socket, so an ICMP port unreachable from one peer mustn't fail its reads
+    BOOL report_connection_reset = FALSE;
+    DWORD bytes_returned;
+    WSAIoctl(socket.native_handle(), SIO_UDP_CONNRESET, &report_connection_reset, sizeof(report_connection_reset),
+        nullptr, 0, &bytes_returned, nullptr, nullptr);
 #endif
+    my_server->set_busy_poll(socket);
 
-int main(int argc, char* argv[]) {
-#ifdef __GNUC__
-#if !defined(__MINGW32__) && !defined(__MINGW64__)
-    signal(SIGSEGV, handle);
-#endif
+    read();
+
+    port = socket.local_endpoint().port();
+    return port;
+}
+
+void udp_router::close() {
+    if (socket.is_open()) {
+        error_code error;
+        socket.close(error);
+    }
+}
+
+uint32_t udp_router::add_user(user* user) {
+    uniform_int_distribution<uint32_t> dist(1);
+    uint32_t token;
+    do {
+        token = dist(token_generator);
+    } while (tokens.find(token) != tokens.end());
+    tokens[token] = user;
+    return token;
+}
+
+void udp_router::remove_user(user* user) {
+    auto it = tokens.find(user->udp_token);
+    if (it != tokens.end() && it->second == user) {
+        tokens.erase(it);
+    }
+    auto jt = endpoints.find(user->udp_endpoint);
+    if (jt != endpoints.end() && jt->second == user) {
+        endpoints.erase(jt);
+    }
+}
+
+void udp_router::send(datagram& d) {
+    if (!socket.is_open()) return;
+
+    if (output_count == output_queue.size()) {
+        output_queue.emplace_back();
+    }
+    auto& q = output_queue[output_count++];
+    q.endpoint = d.endpoint;
+    q.data.swap(d.data);
+    d.data.clear();
+
+    if (!flush_pending) {
+        flush_pending = true;
+        service->post([this] { flush(); });
+    }
+}
+
+void udp_router::flush() {
+    flush_pending = false;
+    if (!socket.is_open() || output_count == 0) return;
+
+    error_code error;
+    send_datagrams(socket, output_queue.data(), output_count, error);
+    for (size_t i = 0; i < output_count; i++) {
+        output_queue[i].data.clear();
+    }
+    output_count = 0;
+}
+
+static ip::address unmap_v4(const ip::address& address) {
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+        return address.to_v6().to_v4();
+    }
+    return address;
+}
+
+user* udp_router::find_user(const ip::udp::endpoint& endpoint, uint32_t token) {
+    auto it = endpoints.find(endpoint);
+    if (it != endpoints.end() && it->second->udp_token == token) {
+        return it->second;
+    }
+
+    auto jt = tokens.find(token);
+    if (jt == tokens.end()) return nullptr;
+
+    // First datagram from this endpoint (or the user's NAT mapping changed). The token alone could be replayed from
+    // anywhere, so the endpoint is only bound when it's on the same host as the user's TCP connection.
+    auto u = jt->second;
+    if (unmap_v4(endpoint.address()) != unmap_v4(u->tcp_address)) return nullptr;
+    remove_user(u);
+    u->udp_endpoint = endpoint;
+    tokens[token] = u;
+    endpoints[endpoint] = u;
+#ifdef _WIN32
+    if (my_server->qos_handle != NULL) {
+        QOS_FLOWID flowId = 0;
+        QOSAddSocketToFlow(my_server->qos_handle, socket.native_handle(), u->udp_endpoint.data(), QOSTrafficTypeAudioVideo, QOS_NON_ADAPTIVE_FLOW, &flowId);
+    }
 #endif
-    log(APP_NAME_AND_VERSION);
-
-    try {
-        uint16_t port = argc >= 2 ? stoi(argv[1]) : 6400;
-        io_service service;
-        server my_server(service, true);
-        my_server.open(port);
-        service.run();
-    } catch (const exception& e) {
-        log(cerr, e.what());
-        return 1;
-    } catch (const error_code& e) {
-        log(cerr, e.message());
-        return 1;
+    return u;
+}
+
+void udp_router::read() {
+    if (input_buffers.empty()) {
+        input_buffers.resize(BATCH_SIZE);
     }
+    socket.async_wait(ip::udp::socket::wait_read, bind_memory(io_memory, [=](const error_code& error) {
+        if (error) return;
+        error_code ec;
+        size_t count;
+        do {
+            count = receive_datagrams(socket, input_buffers, connection::MAX_UDP_SIZE, ec);
+            for (size_t i = 0; i < count; i++) {
+                auto& p = input_buffers[i].data;
+                auto& udp_remote_endpoint = input_buffers[i].endpoint;
+                if (p.empty()) continue;
+                switch (p.read<query_type>()) {
+                    case SERVER_PING: {
+                        packet pong;
+                        pong << SERVER_PONG << PROTOCOL_VERSION;
+                        pong.insert(pong.end(), p.begin() + p.position(), p.end());
+                        error_code error;
+                        socket.send_to(buffer(pong.data(), pong.size()), udp_remote_endpoint, 0, error);
+                        break;
+                    }
+
+                    case EXTERNAL_ADDRESS: {
+                        packet p;
+                        p << EXTERNAL_ADDRESS << udp_remote_endpoint.port();
+                        auto addr = udp_remote_endpoint.address();
+                        if (addr.is_v4()) {
+                            for (auto b : addr.to_v4().to_bytes()) p << b;
+                        } else if (addr.is_v6() && addr.to_v6().is_v4_mapped()) {
+                            for (auto b : addr.to_v6().to_v4().to_bytes()) p << b;
+                        } else {
+                            for (auto b : addr.to_v6().to_bytes()) p << b;
+                        }
+                        error_code error;
+                        socket.send_to(buffer(p.data(), p.size()), udp_remote_endpoint, 0, error);
+                        break;
+                    }
+
+                    case USER_DATA: {
+                        if (p.available() < sizeof(uint32_t)) break;
+                        auto u = find_user(udp_remote_endpoint, p.read<uint32_t>());
+                        if (!u) break;
+                        // The kernel stamps datagrams with the system clock, so compare them against it too. That
+                        // covers the wakeup this thread waited for as well as the time spent dispatching others.
+                        auto received = input_buffers[i].received;
+                        if (received.time_since_epoch().count()) {
+                            my_server->dispatch_latency.add(std::chrono::system_clock::now() - received);
+                        }
+                        u->receive_datagram(p);
+                        break;
+                    }
+                }
+            }
+            if (ec) {
+                if (ec == error::operation_aborted || ec == error::bad_descriptor) return;
+                // Errors such as a connection reset concern a single datagram, so keep reading for everyone else
+                log(cerr, "Failed to receive UDP datagram: " + ec.message());
+                break;
+            }
+        } while (count == input_buffers.size());
+        read();
+    }));
+}
 
-    return 0;
+void latency_histogram::add(std::chrono::nanoseconds latency) {
+    auto us = static_cast<uint64_t>(max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count(), 0));
+    size_t bucket = 0;
+    while (us && bucket < BUCKET_COUNT - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+array<uint64_t, latency_histogram::BUCKET_COUNT> latency_histogram::take() {
+    array<uint64_t, BUCKET_COUNT> counts;
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        counts[i] = buckets[i].exchange(0, memory_order_relaxed);
+    }
+    return counts;
+}
+
+// Percentiles as the upper bound of their bucket, then the full histogram
+string latency_histogram::to_string(const array<uint64_t, BUCKET_COUNT>& counts) {
+    auto total = accumulate(counts.begin(), counts.end(), uint64_t(0));
+    auto percentile = [&](double p) {
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            seen += counts[i];
+            if (seen >= total * p) return i;
+        }
+        return BUCKET_COUNT - 1;
+    };
+    auto bound = [](size_t bucket) {
+        return bucket == BUCKET_COUNT - 1 ? string(">=") + std::to_string(1 << (bucket - 1)) + "us" : "<" + std::to_string(1 << bucket) + "us";
+    };
+
+    stringstream ss;
+    ss << "p50 " << bound(percentile(0.5)) << ", p99 " << bound(percentile(0.99)) << ", max " << bound(percentile(1.0)) << " (" << total << " samples) [";
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        if (!counts[i]) continue;
+        ss << " " << bound(i) << ":" << counts[i];
+    }
+    ss << " ]";
+    return ss.str();
+}
+
+size_t udp_router::endpoint_hash::operator()(const ip::udp::endpoint& endpoint) const {
+    size_t result = endpoint.port();
+    auto addr = endpoint.address();
+    if (addr.is_v4()) {
+        result ^= hash<uint32_t>()(addr.to_v4().to_uint()) << 1;
+    } else {
+        for (auto b : addr.to_v6().to_bytes()) {
+            result = result * 31 + b;
+        }
+    }
+    return result;
 }
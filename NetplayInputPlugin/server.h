@@ -3,38 +3,122 @@
 #include "stdafx.h"
 
 #include "common.h"
+#include "connection.h"
 #include "packet.h"
 #include "room.h"
 
+// Opt-in relay settings that spend CPU to cut latency
+struct low_latency_options {
+    std::vector<int> cpus; // Cores for the main loop, then each worker in turn
+    std::chrono::microseconds spin_budget = std::chrono::microseconds::zero(); // How long a loop keeps polling after its last handler before it blocks
+    int busy_poll = 0; // SO_BUSY_POLL microseconds for relay sockets, where available
+
+    bool enabled() const { return !cpus.empty() || spin_budget.count() || busy_poll; }
+};
+
+// Counts latencies in power of two buckets of microseconds
+class latency_histogram {
+public:
+    constexpr static size_t BUCKET_COUNT = 20; // The last bucket holds everything from about a quarter second up
+
+    void add(std::chrono::nanoseconds latency);
+    std::array<uint64_t, BUCKET_COUNT> take();
+    static std::string to_string(const std::array<uint64_t, BUCKET_COUNT>& counts);
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> buckets = {};
+};
+
+class udp_router {
+public:
+    udp_router(asio::io_service& service, server* server);
+
+    asio::io_service& get_service();
+    uint16_t get_port() const;
+    uint16_t open(const asio::ip::udp::endpoint& endpoint);
+    void close();
+    uint32_t add_user(user* user);
+    void remove_user(user* user);
+    void send(datagram& datagram);
+
+private:
+    struct endpoint_hash {
+        size_t operator()(const asio::ip::udp::endpoint& endpoint) const;
+    };
+
+    void read();
+    void flush();
+    user* find_user(const asio::ip::udp::endpoint& endpoint, uint32_t token);
+
+    asio::io_service* service;
+    server* my_server;
+    asio::ip::udp::socket socket;
+    uint16_t port = 0;
+    std::unordered_map<uint32_t, user*> tokens;
+    std::unordered_map<asio::ip::udp::endpoint, user*, endpoint_hash> endpoints;
+    std::mt19937 token_generator;
+    std::vector<datagram> input_buffers;
+    std::vector<datagram> output_queue;
+    size_t output_count = 0;
+    bool flush_pending = false;
+    std::shared_ptr<handler_memory> io_memory = std::make_shared<handler_memory>();
+
+    constexpr static size_t BATCH_SIZE = 64;
+};
+
 class server {
 public:
-    server(asio::io_service& service, bool multiroom);
+    server(asio::io_service& service, bool multiroom, size_t worker_count = 0, const low_latency_options& options = low_latency_options());
+    ~server();
 
     uint16_t open(uint16_t port);
     void close();
     void on_user_join(user* user, std::string room);
     void on_user_quit(user* user);
+    void on_room_start(room* room);
     void on_room_close(room* room);
     void log_room_list();
 
 private:
+    struct worker {
+        worker(server* server, std::chrono::microseconds spin_budget) : loop(spin_budget), router(loop.service, server) { }
+
+        service_wrapper loop;
+        udp_router router;
+    };
+
     void accept();
-    void read();
     void on_tick();
+    void set_busy_poll(asio::ip::tcp::socket& socket);
+    void set_busy_poll(asio::ip::udp::socket& socket);
     std::string get_random_room_id();
+    udp_router& get_room_router(const std::string& room_id);
     
     asio::io_service* service;
+    std::vector<std::unique_ptr<worker>> workers;
     bool multiroom;
+    low_latency_options options;
+    latency_histogram dispatch_latency; // From the kernel receiving a relayed datagram to dispatching it, where the kernel reports that
     asio::ip::tcp::acceptor acceptor;
-    asio::ip::udp::socket udp_socket;
+    udp_router router;
     asio::steady_timer timer;
+    std::shared_ptr<handler_memory> io_memory = std::make_shared<handler_memory>();
     std::map<std::string, std::shared_ptr<room>, ci_less> rooms;
+    std::unordered_set<room*> started_rooms;
     std::unordered_map<user*, std::shared_ptr<user>> users;
+    std::unordered_set<user*> moving_users; // Moved to a worker's service, but not handed over to it yet
     uint32_t tick_count = 0;
+    std::atomic<uint64_t> relayed_input_count = { 0 };
+    uint64_t last_relayed_input_count = 0;
+    uint64_t last_udp_syscall_count = 0;
+    uint64_t last_pool_hit_count = 0;
+    uint64_t last_pool_miss_count = 0;
+    uint64_t last_handler_allocation_count = 0;
 #ifdef _WIN32
     HANDLE qos_handle = NULL;
 #endif
 
     friend room;
     friend user;
+    friend udp_router;
 };
@@ -10,11 +10,14 @@
 #include <algorithm>
 #include <array>
 #include <asio.hpp>
+#include <atomic>
 #include <cctype>
 #include <chrono>
 #include <cmath>
 #include <codecvt>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <exception>
 #include <functional>
@@ -27,9 +30,11 @@
 #include <mutex>
 #include <numeric>
 #include <random>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <utility>
 
@@ -55,6 +60,12 @@ typedef UINT32 QOS_FLOWID, *PQOS_FLOWID;
 #endif
 #endif
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
 #ifdef DEBUG
 #include <fstream>
 #include <iomanip>
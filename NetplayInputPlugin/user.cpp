@@ -8,15 +8,24 @@ using namespace std;
 using namespace asio;
 
 user::user(server* server) :
-    connection(*server->service), my_server(server) { }
+    connection(*server->service), my_server(server) {
+    udp_socket.reset(); // Game UDP traffic goes through the server's udp_router
+    receive_bounds = TO_SERVER_BOUNDS;
+}
 
 void user::set_room(room* room) {
     this->my_room = room;
+    if (my_router) {
+        udp_token = my_router->add_user(this);
+    }
 
-    send(packet() << PATH << ("/" + room->get_id()));
+    send<to_client<PATH>>("/" + room->get_id());
 }
 
 void user::on_error(const error_code& error) {
+    if (error == asio::error::no_buffer_space) {
+        log((my_room ? "[" + my_room->get_id() + "] " : string()) + name + " stopped reading and was disconnected");
+    }
     if (my_room) {
         my_room->on_user_quit(this);
         my_room = nullptr;
@@ -48,68 +57,13 @@ void user::on_receive(packet& p, bool udp) {
                 room = room.substr(1);
             }
             dynamic_cast<user_info&>(*this) = p.read<user_info>();
-            auto udp_port = p.read<uint16_t>();
-            if (udp_socket && udp_port) {
-                auto local_endpoint = ip::udp::endpoint(tcp_socket->local_endpoint().address(), 0);
-                auto remote_endpoint = ip::udp::endpoint(tcp_socket->remote_endpoint().address(), udp_port);
-                udp_socket->open(local_endpoint.protocol());
-                udp_socket->bind(local_endpoint);
-                udp_socket->connect(remote_endpoint);
-#ifdef _WIN32
-                if (my_server->qos_handle != NULL) {
-                    QOS_FLOWID flowId = 0;
-                    QOSAddSocketToFlow(my_server->qos_handle, udp_socket->native_handle(), udp_socket->remote_endpoint().data(), QOSTrafficTypeAudioVideo, QOS_NON_ADAPTIVE_FLOW, &flowId);
-                }
-#else
-                if (udp_socket->local_endpoint().address().is_v6()) {
-                    udp_socket->set_option(asio::detail::socket_option::integer<IPPROTO_IPV6, IPV6_TCLASS>(40 << 2));
-                } else {
-                    udp_socket->set_option(asio::detail::socket_option::integer<IPPROTO_IP, IP_TOS>(40 << 2));
-                }
-#endif
-                receive_udp_packet();
-            } else {
-                udp_socket.reset();
-            }
-            auto s(weak_from_this());
-            query_udp_port([=]() {
-                if (s.expired()) return;
-                my_server->on_user_join(this, room);
-            });
-            break;
-        }
-
-        case PING: {
-            packet pong;
-            pong << PONG;
-            while (p.available()) {
-                pong << p.read<uint8_t>();
-            }
-            if (udp) {
-                send_udp(pong);
-            } else {
-                send(pong);
-            }
-            break;
-        }
-
-        case PONG: {
-            if (udp && !udp_established) {
-                udp_established = true;
-                tcp_socket->set_option(ip::tcp::no_delay(false));
-                log("[" + my_room->get_id() + "] " + name + " established UDP communication");
-            }
-            latency = timestamp() - p.read<double>();
-            latency_history.push_back(latency);
-            while (latency_history.size() > 5) {
-                latency_history.pop_front();
-            }
+            my_server->on_user_join(this, room);
             break;
         }
 
         case NAME: {
             string old_name = name;
-            p.read(name);
+            read_message<to_server<NAME>>(p, name);
             trim(name);
             log("[" + my_room->get_id() + "] " + old_name + " is now " + name);
             for (auto& u : my_room->user_list) {
@@ -120,7 +74,8 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case MESSAGE: {
-            auto message = p.read<string>();
+            string message;
+            read_message<to_server<MESSAGE>>(p, message);
             for (auto& u : my_room->user_list) {
                 if (u->id == id) continue;
                 u->send_message(id, message);
@@ -129,9 +84,9 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case LAG: {
-            auto lag = p.read<uint8_t>();
-            auto source_lag = p.read<bool>();
-            auto room_lag = p.read<bool>();
+            uint8_t lag;
+            bool source_lag, room_lag;
+            read_message<to_server<LAG>>(p, lag, source_lag, room_lag);
             if (source_lag) {
                 set_lag(lag, this);
                 log("[" + my_room->get_id() + "] " + name + " set their lag to " + to_string((int)lag));
@@ -145,7 +100,8 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case AUTOLAG: {
-            auto value = p.read<int8_t>();
+            int8_t value;
+            read_message<to_server<AUTOLAG>>(p, value);
             if (value == (int8_t)my_room->autolag) break;
 
             if (value == 0) {
@@ -166,9 +122,7 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case CONTROLLERS: {
-            for (auto& c : controllers) {
-                p >> c;
-            }
+            read_message<to_server<CONTROLLERS>>(p, controllers[0], controllers[1], controllers[2], controllers[3]);
             if (!my_room->started) {
                 my_room->update_controller_map();
             }
@@ -184,12 +138,15 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case GOLF: {
-            auto golf = p.read<bool>();
+            bool golf;
+            read_message<to_server<GOLF>>(p, golf);
             if (my_room->golf == golf) break;
             my_room->golf = golf;
+            auto shared(packet_pool::make(p.size()));
+            *shared = p;
             for (auto& u : my_room->user_list) {
                 if (u->id == id) continue;
-                u->send(p);
+                u->send(shared);
             }
             if (golf) {
                 log("[" + my_room->get_id() + "] " + name + " enabled golf mode");
@@ -200,10 +157,10 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case INPUT_MAP: {
-            map = p.read<input_map>();
+            read_message<to_server<INPUT_MAP>>(p, map);
             manual_map = true;
-            packet p;
-            p << INPUT_MAP << id << map;
+            auto p(packet_pool::make());
+            *p << INPUT_MAP << id << map;
             for (auto& u : my_room->user_list) {
                 if (u->id == id) continue;
                 u->send(p);
@@ -213,38 +170,16 @@ void user::on_receive(packet& p, bool udp) {
             break;
         }
 
-        case INPUT_DATA: {
-            auto user = my_room->user_map.at(p.read_var<uint32_t>());
-            if (!user) break;
-            auto i = p.read_var<uint32_t>();
-            packet pin;
-            pin.transpose(p.read_rle(), input_data::SIZE);
-            while (pin.available()) {
-                if (user->add_input_history(i++, pin.read<input_data>())) {
-                    for (auto& u : my_room->user_list) {
-                        if (u->id == id) continue;
-                        u->write_input_from(user);
-                    }
-                }
-            }
-            break;
-        }
-
-        case INPUT_UPDATE: {
-            auto authority_user = my_room->user_map.at(authority);
-            if (!authority_user) break;
-            authority_user->send_input_update(id, p.read<input_data>());
-            break;
-        }
-
         case INPUT_RATE: {
-            input_rate = p.read<float>();
+            read_message<to_server<INPUT_RATE>>(p, input_rate);
             break;
         }
 
         case REQUEST_AUTHORITY: {
-            auto user = my_room->user_map.at(p.read<uint32_t>());
-            auto authority = my_room->user_map.at(p.read<uint32_t>());
+            uint32_t user_id, authority_id;
+            read_message<to_server<REQUEST_AUTHORITY>>(p, user_id, authority_id);
+            auto user = my_room->user_map.at(user_id);
+            auto authority = my_room->user_map.at(authority_id);
             if (!user || !authority) break;
             for (auto& u : my_room->user_list) {
                 if (u->id == id) continue;
@@ -254,8 +189,10 @@ void user::on_receive(packet& p, bool udp) {
         }
 
         case DELEGATE_AUTHORITY: {
-            auto user = my_room->user_map.at(p.read<uint32_t>());
-            auto authority = my_room->user_map.at(p.read<uint32_t>());
+            uint32_t user_id, authority_id;
+            read_message<to_server<DELEGATE_AUTHORITY>>(p, user_id, authority_id);
+            auto user = my_room->user_map.at(user_id);
+            auto authority = my_room->user_map.at(authority_id);
             if (!user || !authority) break;
             user->authority = authority->id;
             for (auto& u : my_room->user_list) {
@@ -277,10 +214,106 @@ void user::on_receive(packet& p, bool udp) {
     }
 }
 
+bool user::on_receive(packet_reader message, bool udp) {
+    if (!my_room) return false;
+
+    auto r = message;
+    packet_type type;
+    r.read(type);
+    switch (type) {
+        case PING: {
+            packet pong;
+            pong << PONG;
+            pong.insert(pong.end(), r.position(), r.position() + r.available());
+            if (udp) {
+                send_udp(pong);
+            } else {
+                send(pong);
+            }
+            break;
+        }
+
+        case PONG: {
+            double time;
+            if (!read_message<to_server<PONG>>(r, time)) break;
+            if (udp && !udp_established) {
+                udp_established = true;
+                tcp_socket->set_option(ip::tcp::no_delay(false));
+                log("[" + my_room->get_id() + "] " + name + " established UDP communication");
+            }
+            latency = timestamp() - time;
+            latency_history.push_back(latency);
+            while (latency_history.size() > 5) {
+                latency_history.pop_front();
+            }
+            break;
+        }
+
+        case INPUT_DATA: {
+            uint32_t user_id, start_id;
+            r.read_var(user_id);
+            r.read_var(start_id);
+            if (user_id >= my_room->user_map.size()) r.fail();
+            if (!r) break;
+            auto user = my_room->user_map[user_id];
+            if (!user) break;
+            auto input_id = user->input_id;
+            auto window = r;
+            user->add_input_window(r, start_id, [](const input_data&) { });
+            if (user->input_id == input_id) break; // Nothing new
+            my_server->relayed_input_count += user->input_id - input_id;
+            if (r && !r.available()) {
+                uint32_t count;
+                window.read_var(count);
+                user->adopt_input_window(message, start_id, count);
+            }
+            for (auto& u : my_room->user_list) {
+                if (u->id == id) continue;
+                u->write_input_from(user);
+            }
+            break;
+        }
+
+        case INPUT_UPDATE: {
+            input_data input;
+            if (!read_message<to_server<INPUT_UPDATE>>(r, input)) break;
+            auto authority_user = my_room->user_map.at(authority);
+            if (!authority_user) break;
+            authority_user->send_input_update(id, input);
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    if (!r) on_malformed(udp);
+    return true;
+}
+
+void user::close_udp() {
+    if (my_router) {
+        my_router->remove_user(this);
+    }
+    udp_endpoint = ip::udp::endpoint();
+    connection::close_udp();
+}
+
+bool user::is_udp_open() {
+    return my_router && udp_endpoint.port() != 0;
+}
+
+void user::write_udp(datagram* datagrams, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        datagrams[i].endpoint = udp_endpoint;
+        my_router->send(datagrams[i]);
+    }
+}
+
 void user::set_lag(uint8_t lag, user* source) {
     this->lag = lag;
-    packet p;
-    p << LAG << lag << (source ? source->id : 0xFFFFFFFF) << id;
+    auto p(packet_pool::make());
+    *p << LAG << lag << (source ? source->id : 0xFFFFFFFF) << id;
     for (auto& u : my_room->user_list) {
         u->send(p);
     }
@@ -290,13 +323,21 @@ void user::send_keepalive() {
     send(packet());
 }
 
+void user::log_output_queue() {
+    if (peak_output_queue_depth <= limits.high_watermark && superseded_count == 0) return;
+    auto prefix = my_room ? "[" + my_room->get_id() + "] " : string();
+    log(prefix + name + "'s output queue peaked at " + to_string(peak_output_queue_depth) + " bytes, " + to_string(superseded_count) + " messages superseded");
+    peak_output_queue_depth = get_output_queue_depth();
+    superseded_count = 0;
+}
+
 void user::send_protocol_version() {
-    send(packet() << VERSION << PROTOCOL_VERSION);
+    send<to_client<VERSION>>(PROTOCOL_VERSION);
 }
 
 void user::send_accept() {
     packet p;
-    p << ACCEPT << external_udp_port;
+    p << ACCEPT << (my_router ? my_router->get_port() : static_cast<uint16_t>(0)) << udp_token;
     for (auto& u : my_room->user_map) {
         if (u) {
             p << true << dynamic_cast<user_info&>(*u);
@@ -308,23 +349,23 @@ void user::send_accept() {
 }
 
 void user::send_join(const user_info& info) {
-    send(packet() << JOIN << info);
+    send<to_client<JOIN>>(info);
 }
 
 void user::send_start_game() {
-    send(packet() << START);
+    send<to_client<START>>();
 }
 
 void user::send_name(uint32_t user_id, const string& name) {
-    send(packet() << NAME << user_id << name);
+    send<to_client<NAME>>(user_id, name);
 }
 
 void user::send_quit(uint32_t id) {
-    send(packet() << QUIT << id);
+    send<to_client<QUIT>>(id);
 }
 
 void user::send_message(uint32_t id, const string& message) {
-    send(packet() << MESSAGE << id << message);
+    send<to_client<MESSAGE>>(id, message);
 }
 
 void user::send_info(const string& message) {
@@ -336,32 +377,65 @@ void user::send_error(const string& message) {
 }
 
 void user::send_ping() {
-    packet p;
-    p << PING << timestamp();
-    if (timestamp() > join_timestamp + 1.0) {
-        send_udp(p);
+    auto now = timestamp();
+    if (now > join_timestamp + 1.0) {
+        send_udp<to_client<PING>>(now);
     }
     if (!udp_established) {
-        send(p);
+        send<to_client<PING>>(now);
     }
 }
 
+void user::adopt_input_window(const packet_reader& message, uint32_t first_id, uint32_t count) {
+    // Only a complete history window can stand in for our own encoding. Its frames before the ones it added are
+    // skipped by every reader, so they needn't match ours.
+    uint32_t end_id = first_id + count;
+    if (end_id != input_id || count != min(end_id, INPUT_HISTORY_LENGTH)) return;
+
+    // Relay the window as received over UDP, and every frame it added over TCP
+    auto tcp_first_id = encoded_input_id;
+    encoded_input_id = input_id;
+    auto p = packet_pool::make(message.available());
+    p->assign(message.position(), message.position() + message.available());
+    udp_input_encoding = p;
+    encode_tcp_input(tcp_first_id);
+}
+
+void user::encode_input() {
+    if (encoded_input_id == input_id) return;
+    auto tcp_first_id = encoded_input_id;
+    encoded_input_id = input_id;
+
+    // Fresh packets each time, since writes still in flight may share the previous ones
+    auto p(packet_pool::make(udp_input_encoding ? udp_input_encoding->size() : 0));
+    *p << INPUT_DATA;
+    p->write_var(id);
+    p->write_var(input_id - input_history.size());
+    write_input_window(*p, input_history);
+    udp_input_encoding = p;
+
+    encode_tcp_input(tcp_first_id);
+}
+
+// TCP doesn't lose packets, so its encoding only carries the frames added since the last one
+void user::encode_tcp_input(uint32_t first_id) {
+    first_id = max(first_id, input_id - static_cast<uint32_t>(input_history.size()));
+    auto p(packet_pool::make(tcp_input_encoding ? tcp_input_encoding->size() : 0));
+    *p << INPUT_DATA;
+    p->write_var(id);
+    p->write_var(first_id);
+    write_input_window(*p, input_history, input_history.size() - (input_id - first_id));
+    tcp_input_encoding = p;
+}
+
 void user::write_input_from(user* user) {
+    user->encode_input();
+
     if (udp_established) {
-        packet p;
-        p << INPUT_DATA;
-        p.write_var(user->id);
-        p.write_var(user->input_id - user->input_history.size());
-        p.write_rle(packet() << user->input_history);
-        send_udp(p, false);
+        send_udp(*user->udp_input_encoding, false);
     }
 
-    packet p;
-    p << INPUT_DATA;
-    p.write_var(user->id);
-    p.write_var(user->input_id - 1);
-    p.write_rle(packet() << user->input_history.back());
-    send(p, false);
+    send(user->tcp_input_encoding, false);
 
     for (auto& u : my_room->user_list) {
         if (u->authority == id) continue;
@@ -373,16 +447,16 @@ void user::write_input_from(user* user) {
 
 void user::send_input_update(uint32_t id, const input_data& input) {
     if (udp_established) {
-        send_udp(packet() << INPUT_UPDATE << id << input);
+        send_udp<to_client<INPUT_UPDATE>>(id, input);
     } else {
-        send(packet() << INPUT_UPDATE << id << input);
+        send_latest<to_client<INPUT_UPDATE>>(id, id, input);
     }
 }
 
 void user::send_request_authority(uint32_t user_id, uint32_t authority_id) {
-    send(packet() << REQUEST_AUTHORITY << user_id << authority_id);
+    send<to_client<REQUEST_AUTHORITY>>(user_id, authority_id);
 }
 
 void user::send_delegate_authority(uint32_t user_id, uint32_t authority_id) {
-    send(packet() << DELEGATE_AUTHORITY << user_id << authority_id);
+    send<to_client<DELEGATE_AUTHORITY>>(user_id, authority_id);
 }
@@ -12,12 +12,15 @@ class user : public connection, public user_info {
     public:
         user(server* server);
         virtual void on_receive(packet& packet, bool udp);
+        virtual bool on_receive(packet_reader message, bool udp);
         virtual void on_error(const std::error_code& error);
+        virtual void close_udp();
         void set_room(room* room);
         double get_latency() const;
         void write_input_from(user* from);
         void set_lag(uint8_t lag, user* source);
         void send_keepalive();
+        void log_output_queue();
         void send_protocol_version();
         void send_accept();
         void send_join(const user_info& info);
@@ -32,14 +35,30 @@ class user : public connection, public user_info {
         void send_request_authority(uint32_t user_id, uint32_t authority_id);
         void send_delegate_authority(uint32_t user_id, uint32_t authority_id);
 
+    protected:
+        virtual bool is_udp_open();
+        virtual void write_udp(datagram* datagrams, size_t count);
+
     private:
         server* my_server;
         room* my_room = nullptr;
+        udp_router* my_router = nullptr;
+        asio::ip::udp::endpoint udp_endpoint;
+        uint32_t udp_token = 0;
         std::string address;
+        asio::ip::address tcp_address; // Where the user connected from, which their UDP traffic must match
         float input_rate = 0;
         std::list<double> latency_history;
         double join_timestamp = INFINITY;
+        uint32_t encoded_input_id = 0; // The input_id the cached encodings below were built for
+        std::shared_ptr<const packet> udp_input_encoding;
+        std::shared_ptr<const packet> tcp_input_encoding;
+
+        void adopt_input_window(const packet_reader& message, uint32_t first_id, uint32_t count);
+        void encode_input();
+        void encode_tcp_input(uint32_t first_id);
 
         friend class room;
         friend class server;
+        friend class udp_router;
 };